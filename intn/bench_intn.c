@@ -0,0 +1,500 @@
+/*
+ * Userspace benchmark for the /dev/intn driver
+ *
+ * Copyright (C) 2014 Rafael do Nascimento Pereira <rnp@25ghz.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This program measures how many counter operations per second /dev/intn
+ * sustains. N threads, each pinned to its own CPU and with its own open
+ * file, run the same number of operations:
+ *
+ * single    INTN_IOC_ADD on counter 0, every thread on the same cache line
+ * array     INTN_IOC_ADD on counter (thread % counters), load the module
+ *           with nr_counters=<counters> for it
+ * snapshot  one preadv() of all the counters in binary mode
+ * write     one pwrite() of a single INTN_F_DELTA record per addition, on
+ *           counter (thread % counters)
+ * uring     INTN_OP_ADD as IORING_OP_URING_CMD on counter
+ *           (thread % counters), <depth> commands per io_uring_enter()
+ *
+ * The results are printed as CSV on stdout, one line per mode, with the
+ * operations and the syscalls per second.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "intn.h"
+
+#define NUM_THREADS 4
+#define DEVFILE     "/dev/intn"
+#define NR_OPS      1000000UL
+#define NR_IOV      4
+#define DEPTH       64
+
+const char *opthelp = "-h\0";
+
+enum mode {
+	M_SINGLE,
+	M_ARRAY,
+	M_SNAPSHOT,
+	M_WRITE,
+	M_URING,
+	NR_MODES
+};
+
+static const char *mode_names[NR_MODES] = {
+	"single", "array", "snapshot", "write", "uring"
+};
+
+struct tdata {
+	uint32_t tnum;
+	const char *dev;
+	enum mode m;
+	uint32_t counters;
+	uint32_t depth;
+	uint64_t ops;
+	uint64_t syscalls;
+	pthread_barrier_t *start;
+	int64_t sink;
+	int err;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pin(uint32_t tnum)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(tnum % (ncpus > 0 ? ncpus : 1), &set);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		fprintf(stderr, "thread[%u]: could not pin to a CPU\n", tnum);
+}
+
+static int run_add(struct tdata *t, int fd, uint32_t index)
+{
+	struct intn_op op;
+	uint64_t i;
+
+	memset(&op, 0, sizeof(op));
+	op.index = index;
+	op.arg = 1;
+
+	for (i = 0; i < t->ops; i++)
+		if (ioctl(fd, INTN_IOC_ADD, &op) < 0)
+			return -1;
+
+	t->syscalls = t->ops;
+	t->sink = op.result;
+	return 0;
+}
+
+static int run_write(struct tdata *t, int fd, uint32_t index)
+{
+	uint32_t flags = INTN_F_DELTA;
+	int64_t delta = 1;
+	uint64_t i;
+
+	if (ioctl(fd, INTN_IOC_SET_FLAGS, &flags) < 0)
+		return -1;
+
+	for (i = 0; i < t->ops; i++)
+		if (pwrite(fd, &delta, sizeof(delta), index * sizeof(delta)) !=
+				sizeof(delta))
+			return -1;
+
+	t->syscalls = t->ops;
+	return 0;
+}
+
+/* an io_uring with 128 byte SQEs and 32 byte CQEs, set up by hand */
+struct ring {
+	int fd;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	char *sqes;
+	char *cqes;
+};
+
+static int ring_init(struct ring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+
+	if (r->fd < 0)
+		return -1;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes +
+		p.cq_entries * 2 * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+
+	if (sq == MAP_FAILED)
+		return -1;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd,
+				IORING_OFF_CQ_RING);
+
+	if (cq == MAP_FAILED)
+		return -1;
+
+	r->sqes = mmap(NULL, p.sq_entries * 2 * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+
+	if (r->sqes == MAP_FAILED)
+		return -1;
+
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = cq + p.cq_off.cqes;
+	return 0;
+}
+
+/* queues depth additions at a time and reaps them, one syscall per batch */
+static int run_uring(struct tdata *t, int fd, uint32_t index)
+{
+	struct intn_uring_cmd *cmd;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail, i, n, slot;
+	uint64_t done = 0;
+	struct ring r;
+
+	if (ring_init(&r, t->depth)) {
+		fprintf(stderr, "thread[%u]: io_uring setup failed\n", t->tnum);
+		return -1;
+	}
+
+	while (done < t->ops) {
+		n = t->ops - done < t->depth ? t->ops - done : t->depth;
+		tail = *r.sq_tail;
+
+		for (i = 0; i < n; i++, tail++) {
+			slot = tail & *r.sq_mask;
+			sqe = (struct io_uring_sqe *)(r.sqes + slot * 128);
+			memset(sqe, 0, 128);
+			sqe->opcode = IORING_OP_URING_CMD;
+			sqe->fd = fd;
+			sqe->cmd_op = INTN_OP_ADD;
+			cmd = (struct intn_uring_cmd *)sqe->cmd;
+			cmd->index = index;
+			cmd->arg = 1;
+			r.sq_array[slot] = slot;
+		}
+
+		__atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+
+		if (syscall(__NR_io_uring_enter, r.fd, n, n,
+					IORING_ENTER_GETEVENTS, NULL, 0) != n)
+			return -1;
+
+		t->syscalls++;
+		head = *r.cq_head;
+
+		while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = (struct io_uring_cqe *)(r.cqes +
+					(head & *r.cq_mask) * 32);
+
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				return -1;
+			}
+
+			t->sink = cqe->big_cqe[0];
+			head++;
+			done++;
+		}
+
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	close(r.fd);
+	return 0;
+}
+
+/* reads all the counters with one preadv(), split over NR_IOV buffers */
+static int run_snapshot(struct tdata *t, int fd)
+{
+	size_t len = t->counters * sizeof(int64_t);
+	size_t seg = (len + NR_IOV - 1) / NR_IOV;
+	struct iovec iov[NR_IOV];
+	uint32_t flags = INTN_F_BINARY;
+	int64_t *values;
+	uint64_t i;
+	int n;
+
+	if (ioctl(fd, INTN_IOC_SET_FLAGS, &flags) < 0)
+		return -1;
+
+	values = calloc(t->counters, sizeof(*values));
+
+	if (!values)
+		return -1;
+
+	for (n = 0; n < NR_IOV && (size_t)n * seg < len; n++) {
+		iov[n].iov_base = (char *)values + n * seg;
+		iov[n].iov_len = len - n * seg < seg ? len - n * seg : seg;
+	}
+
+	for (i = 0; i < t->ops; i++) {
+		if (preadv(fd, iov, n, 0) != (ssize_t)len) {
+			free(values);
+			return -1;
+		}
+	}
+
+	t->syscalls = t->ops;
+	t->sink = values[0];
+	free(values);
+	return 0;
+}
+
+void *bench_thread(void *data)
+{
+	struct tdata *t = data;
+	int fd;
+
+	pin(t->tnum);
+	fd = open(t->dev, O_RDWR);
+
+	if (fd == -1) {
+		fprintf(stderr, "thread[%u]: error opening %s (%s)\n",
+				t->tnum, t->dev, strerror(errno));
+		t->err = errno;
+	}
+
+	pthread_barrier_wait(t->start);
+
+	if (t->err)
+		return NULL;
+
+	switch (t->m) {
+	case M_SINGLE:
+		t->err = run_add(t, fd, 0);
+		break;
+	case M_ARRAY:
+		t->err = run_add(t, fd, t->tnum % t->counters);
+		break;
+	case M_SNAPSHOT:
+		t->err = run_snapshot(t, fd);
+		break;
+	case M_WRITE:
+		t->err = run_write(t, fd, t->tnum % t->counters);
+		break;
+	case M_URING:
+		t->err = run_uring(t, fd, t->tnum % t->counters);
+		break;
+	default:
+		break;
+	}
+
+	if (t->err)
+		fprintf(stderr, "thread[%u]: %s failed (%s)\n",
+				t->tnum, mode_names[t->m], strerror(errno));
+
+	close(fd);
+	return NULL;
+}
+
+/* runs one mode on all threads and prints the CSV line */
+static int bench(const char *dev, uint32_t nthreads, enum mode m,
+		uint32_t counters, uint32_t depth, uint64_t ops)
+{
+	pthread_t threads[nthreads];
+	struct tdata data[nthreads];
+	pthread_barrier_t start;
+	uint64_t syscalls = 0;
+	double t0, t1;
+	uint32_t i;
+	int err = 0;
+
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+
+	for (i = 0; i < nthreads; i++) {
+		memset(&data[i], 0, sizeof(data[i]));
+		data[i].tnum = i;
+		data[i].dev = dev;
+		data[i].m = m;
+		data[i].counters = counters;
+		data[i].depth = depth;
+		data[i].ops = ops;
+		data[i].start = &start;
+
+		if (pthread_create(&threads[i], NULL, bench_thread, &data[i])) {
+			fprintf(stderr, "ERROR: could not create thread %u\n", i);
+			exit(-1);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	t0 = now();
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	t1 = now();
+	pthread_barrier_destroy(&start);
+
+	for (i = 0; i < nthreads; i++) {
+		syscalls += data[i].syscalls;
+		err |= data[i].err;
+	}
+
+	if (err)
+		return -1;
+
+	printf("%s,%u,%u,%llu,%.6f,%.3f,%.0f\n", mode_names[m], nthreads,
+			m == M_SINGLE ? 1 : counters,
+			(unsigned long long)ops * nthreads, t1 - t0,
+			ops * nthreads / (t1 - t0) / 1e6, syscalls / (t1 - t0));
+	fflush(stdout);
+	return 0;
+}
+
+void help(void)
+{
+	fprintf(stderr,
+		"llkdd  Copyright (C) 2014 Rafael do Nascimento Pereira\n"
+		"intn device driver userspace benchmark programm\n\n"
+		"bench_intn [-t <threads>] [-c <counters>] [-m <mode>]\n"
+		"           [-o <ops>] [-q <depth>] [-d <device>]\n"
+		"  -t <threads>   concurrent pinned threads, defaults to 4\n"
+		"  -c <counters>  counters of all modes but single,\n"
+		"                 defaults to the number of threads\n"
+		"  -m <mode>      single, array, snapshot, write or uring,\n"
+		"                 defaults to all\n"
+		"  -q <depth>     commands per io_uring_enter(), defaults to 64\n"
+		"  -o <ops>       operations run by every thread, defaults\n"
+		"                 to 1000000\n"
+		"  -d <device>    defaults to /dev/intn\n"
+		"  -h             show this help message\n");
+}
+
+int main(int argc, char *const argv[])
+{
+	const char *dev = DEVFILE;
+	uint32_t nthreads = NUM_THREADS;
+	uint32_t counters = 0;
+	uint32_t depth = DEPTH;
+	uint64_t ops = NR_OPS;
+	int mode = -1;
+	int opt, m;
+
+	if (argc > 1 && !strncmp(argv[1], opthelp, strlen(opthelp))) {
+		help();
+		return 0;
+	}
+
+	while ((opt = getopt(argc, argv, "t:c:m:o:q:d:")) != -1) {
+		switch (opt) {
+		case 't':
+			if (atoi(optarg) <= 0) {
+				printf("invalid number of threads. exiting..\n");
+				return -1;
+			}
+			nthreads = (uint32_t)atoi(optarg);
+			break;
+		case 'c':
+			if (atoi(optarg) <= 0) {
+				printf("invalid number of counters. exiting..\n");
+				return -1;
+			}
+			counters = (uint32_t)atoi(optarg);
+			break;
+		case 'o':
+			ops = strtoull(optarg, NULL, 0);
+			break;
+		case 'q':
+			if (atoi(optarg) <= 0) {
+				printf("invalid depth. exiting..\n");
+				return -1;
+			}
+			depth = (uint32_t)atoi(optarg);
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		case 'm':
+			for (m = 0; m < NR_MODES; m++)
+				if (!strcmp(optarg, mode_names[m]))
+					mode = m;
+
+			if (mode < 0) {
+				printf("invalid mode %s. exiting..\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			help();
+			return -1;
+		}
+	}
+
+	if (!counters)
+		counters = nthreads;
+
+	printf("mode,threads,counters,ops,seconds,Mops/s,syscalls/s\n");
+
+	for (m = 0; m < NR_MODES; m++) {
+		if (mode >= 0 && m != mode)
+			continue;
+
+		if (bench(dev, nthreads, m, counters, depth, ops))
+			return -1;
+	}
+
+	return 0;
+}
@@ -14,8 +14,58 @@
  * GNU General Public License for more details.
  *
  * Dummy character device driver an extended version of /dev/one. It
- * implements concurrency management. Every time a process reads/writes from/to
- * it, a mutex is set, so a value can be read/written.
+ * implements concurrency management. Every read/write takes a mutex for the
+ * time of the operation, so a value can be read/written. Files opened with
+ * O_NONBLOCK get -EAGAIN instead of waiting for the mutex.
+ *
+ * The value is a 64 bit atomic. The ioctls in intn.h update it without
+ * taking the mutex and without any text formatting, one syscall per
+ * operation or per batch of operations.
+ *
+ * Loaded with nr_counters=N the driver keeps N values, each on its own
+ * cache line, selected by the file offset. The text interface reads and
+ * writes value *l, the binary one sees them as an array of N 64 bit
+ * integers and the ioctls take the index in struct intn_op.
+ *
+ * Loaded with percpu=1 the (single) value lives in per-CPU slots instead,
+ * so concurrent increments stay on their own CPU. Exact reads fold all the
+ * slots, files with INTN_F_APPROX set read the cheap, approximate total.
+ *
+ * Files with INTN_F_BINARY set read and write the value as a native 64 bit
+ * integer, with no formatting or parsing. Files with INTN_F_DELTA set
+ * write 64 bit deltas instead, a whole write()/writev() of them is added
+ * to the counter with one atomic operation.
+ *
+ * The device can be mapped read only, the page holds a struct intn_page
+ * that is updated after every change of the first value, as long as
+ * somebody has it mapped. Readers poll it without any syscall.
+ *
+ * poll() reports a file readable once any value changed after the file
+ * last read, or after it was opened. Every change wakes the pollers, the
+ * version a file saw last decides whether it is readable, so a burst of
+ * changes makes a file readable once until it reads again.
+ *
+ * Files with INTN_F_PRIVATE set keep the additions to one counter in the
+ * file and fold them into the counter on fsync(), on close, when they
+ * reach commit_threshold or when another counter is added to. The
+ * INTN_IOC_FLUSH ioctl folds the pending additions of all the files.
+ *
+ * INTN_IOC_WAIT sleeps until a counter is >=, == or != a value. Like a
+ * futex, a commit only wakes the waiters whose condition it satisfied.
+ *
+ * The same operations, plus waiting for a condition on a counter, can be
+ * queued as IORING_OP_URING_CMD on an io_uring with 128 byte SQEs and 32
+ * byte CQEs, so many of them cost a single io_uring_enter().
+ *
+ * /sys/kernel/debug/intn/lock_stats shows how long the mutex was waited
+ * for and held, as log2 histograms in ns kept per CPU. Writing anything to
+ * it resets them.
+ *
+ * /sys/kernel/debug/intn/handoff carries the counters over a reload of
+ * the driver: reading it freezes them and returns their state, loading the
+ * new driver with restore=1 and writing the state back to it resumes them.
+ * Updates fail with -EAGAIN in between, downtime_ns next to it tells how
+ * long that took. "make reload" does the whole sequence.
  */
 
 #include <linux/init.h>
@@ -27,104 +77,1652 @@
 #include <linux/slab.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/atomic.h>
+#include <linux/sched.h>
+#include <linux/percpu_counter.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
+#include <linux/cache.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/sched/clock.h>
+#include <linux/uio.h>
+#include <linux/io_uring.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/sched/signal.h>
+#include <linux/srcu.h>
+#include <linux/hash.h>
+
+#include "intn.h"
 
 #define DEVNAME		"intn"
 #define CLASSNAME	"dummy2"
 #define NR_DEVS		1
 #define INIT_VALUE	25
-#define INT_LEN		12
+#define INT_LEN		21
 #define BASE10		10
 #define DEFAULT_INT	"25"
+#define MAX_COUNTERS	(1 << 20)
 
 static int  intn_major;
 static int  intn_minor;
-static int  int_value;
-static char cint[INT_LEN];
+static struct percpu_counter int_pcpu;
+
+/*
+ * Every counter has its own cache line, writers of different ones never
+ * contend on it. vzalloc() returns page aligned memory.
+ */
+struct intn_slot {
+	atomic64_t value;
+} ____cacheline_aligned_in_smp;
+
+static struct intn_slot *intn_slots;
+
+/* the page shown by mmap(), the lock serializes its writers */
+static struct intn_page *intn_page;
+static DEFINE_SPINLOCK(intn_page_lock);
+static atomic_t intn_page_maps = ATOMIC_INIT(0);
+
+/* bumped by every commit, the files keep the one they read last */
+static atomic64_t intn_version = ATOMIC64_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(intn_poll_wq);
+
+static int nr_counters = 1;
+module_param(nr_counters, int, 0444);
+MODULE_PARM_DESC(nr_counters, "number of counters, selected by the offset");
+
+static bool percpu;
+module_param(percpu, bool, 0444);
+MODULE_PARM_DESC(percpu,
+		"keep the value in per-CPU slots, needs nr_counters=1");
+
+static int batch = 32;
+module_param(batch, int, 0444);
+MODULE_PARM_DESC(batch,
+		"largest per-CPU delta before it is folded into the total");
+
+static unsigned int wait_max_ms = 10000;
+module_param(wait_max_ms, uint, 0644);
+MODULE_PARM_DESC(wait_max_ms,
+		"longest INTN_OP_WAIT on io_uring before it fails with -ETIME");
+
+static long commit_threshold = 1024;
+module_param(commit_threshold, long, 0644);
+MODULE_PARM_DESC(commit_threshold,
+		"largest pending delta of a private file, 0 for no limit");
+
+static bool restore;
+module_param(restore, bool, 0444);
+MODULE_PARM_DESC(restore,
+		"start frozen, waiting for the handoff of the last driver");
+
+/*
+ * Reading the handoff freezes the counters, updates fail with -EAGAIN
+ * until a handoff is written back. Loaded with restore=1 the driver starts
+ * empty, reads fail as well until then. Updates run in an intn_srcu read
+ * section, so the freeze can wait for those which did not see it.
+ */
+enum intn_state {
+	INTN_LIVE,
+	INTN_FROZEN,
+	INTN_EMPTY,
+};
+
+static int intn_state = INTN_LIVE;
+DEFINE_STATIC_SRCU(intn_srcu);
+
+/* bucket i counts the times in [2^i, 2^(i+1)) ns, the last one the rest */
+#define LOCK_HIST_BUCKETS 32
+
+struct intn_lock_stats {
+	u64 acquired;
+	u64 contended;		/* the mutex was held by somebody else */
+	u64 failed;		/* -EAGAIN or interrupted */
+	u64 wait_max;
+	u64 hold_max;
+	u64 wait[LOCK_HIST_BUCKETS];
+	u64 hold[LOCK_HIST_BUCKETS];
+};
 
 struct intn_dev {
 	struct cdev   intn_cdev;
 	struct class  *intn_class;
 	struct device *intn_device;
 	struct mutex  intn_mutex;
+	u64           intn_hold_start;	/* protected by intn_mutex */
+	struct intn_lock_stats __percpu *intn_lstats;
+	struct dentry *intn_debugfs;
+};
+
+struct intn_dev *intn;
+
+/* per open file state */
+struct intn_file {
+	u32 flags;
+	u64 seen;	/* intn_version at the last read */
+	s64 result;	/* INTN_F_DELTA: value after the last write */
+
+	/* INTN_F_PRIVATE: delta pending for counter index */
+	spinlock_t lock;
+	u32 index;
+	s64 delta;
+	struct list_head node;	/* on intn_private, empty if not private */
+};
+
+/* all the files with INTN_F_PRIVATE set */
+static LIST_HEAD(intn_private);
+static DEFINE_SPINLOCK(intn_private_lock);
+
+/* returns value idx, exact unless INTN_F_APPROX is given */
+static s64 intn_get(u32 idx, u32 flags)
+{
+	if (!percpu)
+		return atomic64_read(&intn_slots[idx].value);
+
+	if (flags & INTN_F_APPROX)
+		return percpu_counter_read(&int_pcpu);
+
+	return percpu_counter_sum(&int_pcpu);
+}
+
+static void intn_set(u32 idx, s64 value)
+{
+	if (percpu)
+		percpu_counter_set(&int_pcpu, value);
+	else
+		atomic64_set(&intn_slots[idx].value, value);
+}
+
+static void intn_add(u32 idx, s64 delta)
+{
+	if (percpu)
+		percpu_counter_add_batch(&int_pcpu, delta, batch);
+	else
+		atomic64_add(delta, &intn_slots[idx].value);
+}
+
+/*
+ * A task or io_uring command waiting for a condition on a counter. It is
+ * on its bucket until it is woken or it times out, whoever takes it off
+ * the bucket completes it.
+ */
+struct intn_waiter {
+	struct list_head node;
+	struct list_head woken;
+	struct intn_wait_bucket *bucket;
+	u32 index;
+	u32 cond;
+	s64 val;
+	s64 result;		/* the value that satisfied the condition */
+	int ret;
+
+	/* either a sleeping task or an io_uring command with a timeout */
+	struct task_struct *task;
+	bool done;
+	struct io_uring_cmd *ioucmd;
+	struct hrtimer timer;
 };
 
-struct intn_dev *intn;
+/*
+ * Like futexes, waiters are hashed by counter and those waiting for ==
+ * also by the value, so a commit only looks at the bucket of the counter
+ * it changed and at the bucket of == waiters for the value it left.
+ * nr_waiters counts all of them, commits skip the buckets while it is 0.
+ */
+#define INTN_WAIT_BITS	6
+#define INTN_COMMIT_ALL	U32_MAX		/* a commit of several counters */
+
+struct intn_wait_bucket {
+	spinlock_t lock;
+	struct list_head waiters;
+	atomic_t nr;
+} ____cacheline_aligned_in_smp;
+
+static struct intn_wait_bucket intn_wait_table[1 << INTN_WAIT_BITS];
+static atomic_t intn_nr_waiters = ATOMIC_INIT(0);
+
+static struct intn_wait_bucket *intn_wait_bucket(u32 idx, u32 cond, s64 val)
+{
+	u64 key = idx;
+
+	if (cond == INTN_WAIT_EQ)
+		key = (u64)val ^ hash_32(idx, 32);
+
+	return &intn_wait_table[hash_64(key, INTN_WAIT_BITS)];
+}
+
+/* takes a waiter off its bucket, called with the bucket lock held */
+static void __intn_unlink_waiter(struct intn_waiter *w)
+{
+	list_del_init(&w->node);
+	atomic_dec(&w->bucket->nr);
+	atomic_dec(&intn_nr_waiters);
+}
+
+/* what an io_uring command keeps in its pdu until its completion runs */
+struct intn_uring_pdu {
+	struct intn_waiter *w;
+};
+
+static struct intn_uring_pdu *intn_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	BUILD_BUG_ON(sizeof(struct intn_uring_pdu) > sizeof(ioucmd->pdu));
+	return (struct intn_uring_pdu *)ioucmd->pdu;
+}
+
+static bool intn_cond_met(u32 cond, s64 value, s64 val)
+{
+	switch (cond) {
+	case INTN_WAIT_GE:
+		return value >= val;
+	case INTN_WAIT_EQ:
+		return value == val;
+	case INTN_WAIT_NE:
+		return value != val;
+	}
+
+	return false;
+}
+
+/* runs in the task that queued the command */
+static void intn_uring_done(struct io_uring_cmd *ioucmd)
+{
+	struct intn_waiter *w = intn_uring_pdu(ioucmd)->w;
+	s64 result = w->result;
+	int ret = w->ret;
+
+	kfree(w);
+	io_uring_cmd_done(ioucmd, ret, result);
+}
+
+/*
+ * Completes a waiter taken off the list, its timer is not running. A task
+ * waiter lives on the stack of the task, it is gone once done is set.
+ */
+static void intn_waiter_done(struct intn_waiter *w, int ret)
+{
+	struct task_struct *task = w->task;
+
+	w->ret = ret;
+
+	if (w->ioucmd) {
+		io_uring_cmd_complete_in_task(w->ioucmd, intn_uring_done);
+		return;
+	}
+
+	get_task_struct(task);
+	smp_store_release(&w->done, true);
+	wake_up_process(task);
+	put_task_struct(task);
+}
+
+static enum hrtimer_restart intn_waiter_timeout(struct hrtimer *timer)
+{
+	struct intn_waiter *w = container_of(timer, struct intn_waiter, timer);
+	struct intn_wait_bucket *b = w->bucket;
+	unsigned long irqflags;
+	bool expired;
+
+	spin_lock_irqsave(&b->lock, irqflags);
+	expired = !list_empty(&w->node);
+
+	if (expired)
+		__intn_unlink_waiter(w);
+
+	spin_unlock_irqrestore(&b->lock, irqflags);
+
+	if (expired)
+		intn_waiter_done(w, -ETIME);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Moves the waiters of b on counter idx whose condition holds for value
+ * to woken. With INTN_COMMIT_ALL each waiter reads its own counter, that
+ * only happens with nr_counters > 1, where a read is a plain atomic load.
+ */
+static void intn_wake_bucket(struct intn_wait_bucket *b, u32 idx, s64 value,
+		struct list_head *woken)
+{
+	struct intn_waiter *w, *tmp;
+
+	if (!atomic_read(&b->nr))
+		return;
+
+	spin_lock_irq(&b->lock);
+
+	list_for_each_entry_safe(w, tmp, &b->waiters, node) {
+		if (idx == INTN_COMMIT_ALL)
+			value = intn_get(w->index, 0);
+		else if (w->index != idx)
+			continue;
+
+		if (!intn_cond_met(w->cond, value, w->val))
+			continue;
+
+		w->result = value;
+		__intn_unlink_waiter(w);
+		list_add_tail(&w->woken, woken);
+	}
+
+	spin_unlock_irq(&b->lock);
+}
+
+/*
+ * Completes the waiters of counter idx, or of all the counters, whose
+ * condition holds now. The others stay where they are, it is not a
+ * thundering herd.
+ */
+static void intn_wake_waiters(u32 idx)
+{
+	struct intn_wait_bucket *b, *eq;
+	struct intn_waiter *w, *tmp;
+	LIST_HEAD(woken);
+	s64 value;
+	int i;
+
+	/* the percpu value is the only one, and expensive to sum */
+	if (percpu)
+		idx = 0;
+
+	if (idx == INTN_COMMIT_ALL) {
+		for (i = 0; i < ARRAY_SIZE(intn_wait_table); i++)
+			intn_wake_bucket(&intn_wait_table[i], idx, 0, &woken);
+	} else {
+		value = intn_get(idx, 0);
+		b = intn_wait_bucket(idx, INTN_WAIT_GE, 0);
+		eq = intn_wait_bucket(idx, INTN_WAIT_EQ, value);
+		intn_wake_bucket(b, idx, value, &woken);
+
+		if (eq != b)
+			intn_wake_bucket(eq, idx, value, &woken);
+	}
+
+	list_for_each_entry_safe(w, tmp, &woken, woken) {
+		if (w->ioucmd)
+			hrtimer_cancel(&w->timer);
+
+		intn_waiter_done(w, 0);
+	}
+}
+
+/* puts a waiter on its bucket, it may be completed right away */
+static void intn_add_waiter(struct intn_waiter *w, u64 timeout)
+{
+	struct intn_wait_bucket *b = intn_wait_bucket(w->index, w->cond,
+			w->val);
+
+	w->bucket = b;
+	spin_lock_irq(&b->lock);
+	list_add_tail(&w->node, &b->waiters);
+	atomic_inc(&b->nr);
+	atomic_inc(&intn_nr_waiters);
+
+	if (w->ioucmd)
+		hrtimer_start(&w->timer, ns_to_ktime(timeout),
+				HRTIMER_MODE_REL);
+
+	spin_unlock_irq(&b->lock);
+
+	/* pairs with the barrier in intn_commit(), the value may be there */
+	smp_mb();
+	intn_wake_waiters(w->index);
+}
+
+/*
+ * To be called after every change of counter idx, INTN_COMMIT_ALL if
+ * several of them changed. It wakes the pollers, if there are any,
+ * completes the waiters whose condition is met and publishes the first
+ * value to the mapped page.
+ * The value is read again under the lock, so concurrent commits can not
+ * leave an older value behind. The page is left alone while it is not
+ * mapped.
+ */
+static void intn_commit(u32 idx)
+{
+	struct intn_page *p = intn_page;
+
+	/* fully ordered, pairs with the barrier in intn_poll() */
+	atomic64_inc_return(&intn_version);
+
+	/*
+	 * Edge triggered epoll only calls ->poll again after a wakeup, so
+	 * every change has to wake. Nobody polling costs a read.
+	 */
+	if (waitqueue_active(&intn_poll_wq))
+		wake_up_interruptible_poll(&intn_poll_wq,
+				EPOLLIN | EPOLLRDNORM);
+
+	if (atomic_read(&intn_nr_waiters))
+		intn_wake_waiters(idx);
+
+	if (!atomic_read(&intn_page_maps))
+		return;
+
+	spin_lock(&intn_page_lock);
+	WRITE_ONCE(p->seq, p->seq + 1);
+	smp_wmb();
+	WRITE_ONCE(p->value, intn_get(0, INTN_F_APPROX));
+	WRITE_ONCE(p->time_ns, ktime_get_ns());
+	smp_wmb();
+	WRITE_ONCE(p->seq, p->seq + 1);
+	spin_unlock(&intn_page_lock);
+}
+
+/* folds the pending delta of a private file, called with nf->lock held */
+static bool __intn_fold(struct intn_file *nf)
+{
+	if (!nf->delta)
+		return false;
+
+	intn_add(nf->index, nf->delta);
+	nf->delta = 0;
+	return true;
+}
+
+static void intn_fold(struct intn_file *nf)
+{
+	bool folded;
+	u32 idx;
+
+	spin_lock(&nf->lock);
+	idx = nf->index;
+	folded = __intn_fold(nf);
+	spin_unlock(&nf->lock);
+
+	if (folded)
+		intn_commit(idx);
+}
+
+/* folds the pending deltas of all the private files */
+static void intn_fold_all(void)
+{
+	struct intn_file *nf;
+	bool folded = false;
+
+	spin_lock(&intn_private_lock);
+
+	list_for_each_entry(nf, &intn_private, node) {
+		spin_lock(&nf->lock);
+		folded |= __intn_fold(nf);
+		spin_unlock(&nf->lock);
+	}
+
+	spin_unlock(&intn_private_lock);
+
+	if (folded)
+		intn_commit(INTN_COMMIT_ALL);
+}
+
+/*
+ * Adds to the delta of a private file, the result is the counter as seen
+ * by this file: the approximate value plus what is still pending.
+ */
+static s64 intn_add_private(struct intn_file *nf, u32 idx, s64 arg)
+{
+	bool folded_old = false;
+	bool folded = false;
+	u32 old;
+	s64 delta;
+
+	spin_lock(&nf->lock);
+	old = nf->index;
+
+	if (idx != old) {
+		folded_old = __intn_fold(nf);
+		nf->index = idx;
+	}
+
+	nf->delta += arg;
+
+	if (commit_threshold > 0 && abs(nf->delta) >= commit_threshold)
+		folded = __intn_fold(nf);
+
+	delta = nf->delta;
+	spin_unlock(&nf->lock);
+
+	if (folded_old)
+		intn_commit(old);
+
+	if (folded)
+		intn_commit(idx);
+
+	return intn_get(idx, INTN_F_APPROX) + delta;
+}
+
+/* adds a file to or removes it from the private ones */
+static void intn_set_private(struct intn_file *nf, bool on)
+{
+	spin_lock(&intn_private_lock);
+
+	if (on && list_empty(&nf->node))
+		list_add(&nf->node, &intn_private);
+	else if (!on)
+		list_del_init(&nf->node);
+
+	spin_unlock(&intn_private_lock);
+
+	if (!on)
+		intn_fold(nf);
+}
+
+static unsigned int intn_lock_bucket(u64 ns)
+{
+	return ns ? min_t(unsigned int, ilog2(ns), LOCK_HIST_BUCKETS - 1) : 0;
+}
+
+/*
+ * Takes the device mutex for one operation. Files opened with O_NONBLOCK
+ * never sleep on it, they get -EAGAIN if somebody else holds it.
+ */
+static int intn_lock(struct file *f)
+{
+	struct intn_lock_stats *st;
+	bool contended = false;
+	u64 start = local_clock();
+	u64 ns;
+	int ret = 0;
+
+	if (!mutex_trylock(&intn->intn_mutex)) {
+		contended = true;
+
+		if (f->f_flags & O_NONBLOCK)
+			ret = -EAGAIN;
+		else
+			ret = mutex_lock_interruptible(&intn->intn_mutex);
+	}
+
+	ns = local_clock() - start;
+	st = get_cpu_ptr(intn->intn_lstats);
+	st->contended += contended;
+
+	if (ret) {
+		st->failed++;
+	} else {
+		st->acquired++;
+		st->wait[intn_lock_bucket(ns)]++;
+		st->wait_max = max(st->wait_max, ns);
+	}
+
+	put_cpu_ptr(intn->intn_lstats);
+
+	if (!ret)
+		intn->intn_hold_start = local_clock();
+
+	return ret;
+}
+
+static void intn_unlock(void)
+{
+	struct intn_lock_stats *st;
+	u64 ns = local_clock() - intn->intn_hold_start;
+
+	mutex_unlock(&intn->intn_mutex);
+
+	st = get_cpu_ptr(intn->intn_lstats);
+	st->hold[intn_lock_bucket(ns)]++;
+	st->hold_max = max(st->hold_max, ns);
+	put_cpu_ptr(intn->intn_lstats);
+}
+
+/* sums the per-CPU lock statistics, the watermarks are the largest ones */
+static int intn_lock_stats_show(struct seq_file *m, void *v)
+{
+	struct intn_lock_stats sum, *st;
+	int cpu, i, last = 0;
+
+	memset(&sum, 0, sizeof(sum));
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(intn->intn_lstats, cpu);
+		sum.acquired += st->acquired;
+		sum.contended += st->contended;
+		sum.failed += st->failed;
+		sum.wait_max = max(sum.wait_max, st->wait_max);
+		sum.hold_max = max(sum.hold_max, st->hold_max);
+
+		for (i = 0; i < LOCK_HIST_BUCKETS; i++) {
+			sum.wait[i] += st->wait[i];
+			sum.hold[i] += st->hold[i];
+		}
+	}
+
+	seq_printf(m, "acquired    %llu\n", sum.acquired);
+	seq_printf(m, "contended   %llu\n", sum.contended);
+	seq_printf(m, "failed      %llu\n", sum.failed);
+	seq_printf(m, "wait_max_ns %llu\n", sum.wait_max);
+	seq_printf(m, "hold_max_ns %llu\n", sum.hold_max);
+
+	for (i = 0; i < LOCK_HIST_BUCKETS; i++)
+		if (sum.wait[i] || sum.hold[i])
+			last = i;
+
+	seq_printf(m, "%-12s %12s %12s\n", "ns>=", "wait", "hold");
+
+	for (i = 0; i <= last; i++)
+		seq_printf(m, "%-12llu %12llu %12llu\n", i ? 1ULL << i : 0,
+				sum.wait[i], sum.hold[i]);
+
+	return 0;
+}
+
+static int intn_lock_stats_open(struct inode *inode, struct file *f)
+{
+	return single_open(f, intn_lock_stats_show, NULL);
+}
+
+/* any write resets the statistics, updates running meanwhile may be lost */
+static ssize_t intn_lock_stats_write(struct file *f, const char __user *u,
+		size_t size, loff_t *l)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(intn->intn_lstats, cpu), 0,
+				sizeof(struct intn_lock_stats));
+
+	return size;
+}
+
+static const struct file_operations intn_lock_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = intn_lock_stats_open,
+	.read    = seq_read,
+	.write   = intn_lock_stats_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* enters an update of the counters, fails while they are frozen */
+static int intn_update_begin(int *idx)
+{
+	*idx = srcu_read_lock(&intn_srcu);
+
+	if (READ_ONCE(intn_state) != INTN_LIVE) {
+		srcu_read_unlock(&intn_srcu, *idx);
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+static void intn_update_end(int idx)
+{
+	srcu_read_unlock(&intn_srcu, idx);
+}
+
+#define INTN_HANDOFF_MAGIC 0x4e544e49	/* "INTN" */
+
+/*
+ * The state carried from one instance of the driver to the next one, read
+ * from and written to /sys/kernel/debug/intn/handoff. frozen_ns is the
+ * CLOCK_MONOTONIC time of the freeze, the downtime is measured from it.
+ */
+struct intn_handoff {
+	u32 magic;
+	u32 nr_counters;
+	u64 frozen_ns;
+	s64 values[];
+};
+
+static DEFINE_MUTEX(intn_handoff_lock);
+static u64 intn_frozen_ns;
+static u64 intn_downtime_ns;
+static struct intn_handoff *intn_handoff_in;	/* being written */
+
+static size_t intn_handoff_size(void)
+{
+	return struct_size((struct intn_handoff *)NULL, values, nr_counters);
+}
+
+/*
+ * Stops the updates and waits for the running ones, then folds what the
+ * private files still hold. The values are final afterwards. Called with
+ * intn_handoff_lock held.
+ */
+static void intn_freeze(void)
+{
+	if (READ_ONCE(intn_state) == INTN_LIVE) {
+		intn_frozen_ns = ktime_get_ns();
+		WRITE_ONCE(intn_state, INTN_FROZEN);
+		synchronize_srcu(&intn_srcu);
+	}
+
+	intn_fold_all();
+}
+
+/* opening the handoff for reading freezes the counters and exports them */
+static int intn_handoff_open(struct inode *inode, struct file *f)
+{
+	struct intn_handoff *h;
+	u32 i;
+
+	if (!(f->f_mode & FMODE_READ))
+		return 0;
+
+	h = kvzalloc(intn_handoff_size(), GFP_KERNEL);
+
+	if (!h)
+		return -ENOMEM;
+
+	mutex_lock(&intn_handoff_lock);
+
+	/* the values are not there yet, there is nothing to hand off */
+	if (READ_ONCE(intn_state) == INTN_EMPTY) {
+		mutex_unlock(&intn_handoff_lock);
+		kvfree(h);
+		return -EAGAIN;
+	}
+
+	intn_freeze();
+	h->magic = INTN_HANDOFF_MAGIC;
+	h->nr_counters = nr_counters;
+	h->frozen_ns = intn_frozen_ns;
+
+	for (i = 0; i < nr_counters; i++)
+		h->values[i] = intn_get(i, 0);
+
+	mutex_unlock(&intn_handoff_lock);
+
+	f->private_data = h;
+	return 0;
+}
+
+static ssize_t intn_handoff_read(struct file *f, char __user *u,
+		size_t size, loff_t *l)
+{
+	return simple_read_from_buffer(u, size, l, f->private_data,
+			intn_handoff_size());
+}
+
+/* takes the values of a complete handoff and lets the updates run again */
+static int intn_restore(struct intn_handoff *h)
+{
+	u32 i;
+
+	if (h->magic != INTN_HANDOFF_MAGIC || h->nr_counters != nr_counters) {
+		pr_err("invalid handoff for %u counters\n", h->nr_counters);
+		return -EINVAL;
+	}
+
+	if (READ_ONCE(intn_state) == INTN_LIVE) {
+		pr_err("handoff written while the counters are live\n");
+		return -EBUSY;
+	}
+
+	for (i = 0; i < nr_counters; i++)
+		intn_set(i, h->values[i]);
+
+	intn_downtime_ns = ktime_get_ns() - h->frozen_ns;
+	WRITE_ONCE(intn_state, INTN_LIVE);
+	intn_commit(INTN_COMMIT_ALL);
+	pr_info("state restored %llu ns after the freeze\n", intn_downtime_ns);
+
+	return 0;
+}
+
+/*
+ * The handoff may be written in several pieces, it is restored once all
+ * of it arrived. A new write at offset 0 starts over.
+ */
+static ssize_t intn_handoff_write(struct file *f, const char __user *u,
+		size_t size, loff_t *l)
+{
+	size_t total = intn_handoff_size();
+	ssize_t ret;
+	int err;
+
+	mutex_lock(&intn_handoff_lock);
+
+	if (!intn_handoff_in) {
+		intn_handoff_in = kvzalloc(total, GFP_KERNEL);
+
+		if (!intn_handoff_in) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	ret = simple_write_to_buffer(intn_handoff_in, total, l, u, size);
+
+	if (ret > 0 && *l == total) {
+		err = intn_restore(intn_handoff_in);
+		kvfree(intn_handoff_in);
+		intn_handoff_in = NULL;
+
+		if (err)
+			ret = err;
+	}
+
+out:
+	mutex_unlock(&intn_handoff_lock);
+	return ret;
+}
+
+static int intn_handoff_release(struct inode *inode, struct file *f)
+{
+	kvfree(f->private_data);
+	return 0;
+}
+
+static const struct file_operations intn_handoff_fops = {
+	.owner   = THIS_MODULE,
+	.open    = intn_handoff_open,
+	.read    = intn_handoff_read,
+	.write   = intn_handoff_write,
+	.llseek  = default_llseek,
+	.release = intn_handoff_release,
+};
+
+#define INTN_BIN_CHUNK 16
+
+/*
+ * Reads the array of values from offset *l on, 0 after the end. The values
+ * are read in chunks, every one of them is atomic but the range as a whole
+ * is not.
+ */
+static ssize_t intn_read_bin(char __user *u, size_t size, loff_t *l,
+		u32 flags)
+{
+	loff_t end = (loff_t)nr_counters * sizeof(s64);
+	s64 values[INTN_BIN_CHUNK];
+	size_t done = 0;
+	size_t n, skip;
+	u32 idx, i, cnt;
+
+	if (*l < 0)
+		return -EINVAL;
+
+	if (*l >= end)
+		return 0;
+
+	size = min_t(loff_t, size, end - *l);
+
+	while (done < size) {
+		idx = *l / sizeof(s64);
+		skip = *l % sizeof(s64);
+		cnt = min_t(size_t, DIV_ROUND_UP(skip + size - done,
+					sizeof(s64)), INTN_BIN_CHUNK);
+
+		for (i = 0; i < cnt; i++)
+			values[i] = intn_get(idx + i, flags);
+
+		n = min_t(size_t, size - done, cnt * sizeof(s64) - skip);
+
+		if (copy_to_user(u + done, (char *)values + skip, n))
+			return done ? done : -EFAULT;
+
+		done += n;
+		*l += n;
+	}
+
+	return done;
+}
+
+/*
+ * Stores whole 8 byte values into the array from offset *l on, which has to
+ * be a multiple of 8. A trailing partial value is not written.
+ */
+static ssize_t intn_write_bin(struct intn_file *nf, struct iov_iter *from,
+		loff_t *l)
+{
+	size_t size = iov_iter_count(from);
+	s64 value;
+	u32 idx, i, n;
+
+	if (*l < 0 || *l % sizeof(value))
+		return -EINVAL;
+
+	if (*l >= (loff_t)nr_counters * sizeof(value))
+		return -ENOSPC;
+
+	if (size < sizeof(value))
+		return -EINVAL;
+
+	idx = *l / sizeof(value);
+	n = min_t(size_t, size / sizeof(value), nr_counters - idx);
+	intn_fold(nf);
+
+	for (i = 0; i < n; i++) {
+		if (!copy_from_iter_full(&value, sizeof(value), from))
+			break;
+
+		intn_set(idx + i, value);
+	}
+
+	if (!i)
+		return -EFAULT;
+
+	intn_commit(i == 1 ? idx : INTN_COMMIT_ALL);
+	*l += i * sizeof(value);
+	return i * sizeof(value);
+}
+
+/* the value left by the last delta write, the offset is not used */
+static ssize_t intn_read_result(struct intn_file *nf, char __user *u,
+		size_t size)
+{
+	s64 value = READ_ONCE(nf->result);
+
+	if (size < sizeof(value))
+		return -EINVAL;
+
+	if (copy_to_user(u, &value, sizeof(value)))
+		return -EFAULT;
+
+	return sizeof(value);
+}
+
+/* The read() file opetation, it returns the value as text to user space */
+ssize_t intn_read(struct file *f, char __user *u, size_t size, loff_t *l)
+{
+	struct intn_file *nf = f->private_data;
+	u32 flags = READ_ONCE(nf->flags);
+	char cint[INT_LEN];
+	s64 value;
+	int ret;
+
+	if (u == NULL)
+		return -EFAULT;
+
+	/* loaded with restore=1, nothing to read until the handoff arrives */
+	if (READ_ONCE(intn_state) == INTN_EMPTY)
+		return -EAGAIN;
+
+	/* taken before the value, a change racing with the read is seen */
+	WRITE_ONCE(nf->seen, atomic64_read(&intn_version));
+
+	if (flags & INTN_F_DELTA)
+		return intn_read_result(nf, u, size);
+
+	if (flags & INTN_F_BINARY)
+		return intn_read_bin(u, size, l, flags);
+
+	/* text reads do not move the offset, it selects the value */
+	if (*l < 0)
+		return -EINVAL;
+
+	if (*l >= nr_counters)
+		return 0;
+
+	/* approximate reads are meant to be cheap, they skip the mutex */
+	if (flags & INTN_F_APPROX) {
+		value = intn_get(*l, flags);
+	} else {
+		ret = intn_lock(f);
 
-/* The read() file opetation, it returns only a "1" character to user space */
-ssize_t intn_read(struct file *f, char __user *u, size_t size, loff_t *l)
-{
-	if (u == NULL)
-		return -EFAULT;
+		if (ret)
+			return ret;
+
+		value = intn_get(*l, flags);
+		intn_unlock();
+	}
 
-	if (snprintf(cint, INT_LEN, "%d", int_value) < 0) {
+	if (snprintf(cint, INT_LEN, "%lld", value) < 0) {
 		pr_err("Error converting, returning default value\n");
 		if (!strncpy(cint, DEFAULT_INT, 3))
 			return -EFAULT;
 	}
 
 	/* copy the buffer to user space */
-	if (copy_to_user(u, cint, strlen(cint)) < 0) {
+	if (copy_to_user(u, cint, min(strlen(cint), size))) {
 		pr_err("Error copying buffer to userspace\n");
 		return -EFAULT;
 	} else {
 		/* we return the number of written bytes, always 4 */
 		pr_err("Return %lu bytes to userspace\n", strlen(cint));
-		pr_err("Value read: %d\n", int_value);
-		return strlen(cint);
+		pr_err("Value read: %lld\n", value);
+		return min(strlen(cint), size);
+	}
+}
+
+/*
+ * The per-CPU counter can only add and read. The result of an addition is
+ * always the approximate total, an exact one would take the counter lock
+ * and walk all the CPUs on every increment. LOAD and reads stay exact.
+ */
+static int intn_apply_percpu(struct intn_op *op)
+{
+	switch (op->op) {
+	case INTN_OP_ADD:
+		percpu_counter_add_batch(&int_pcpu, op->arg, batch);
+		break;
+	case INTN_OP_FETCH_ADD:
+	case INTN_OP_CMPXCHG:
+	case INTN_OP_EXCHANGE:
+		return -EOPNOTSUPP;
+	default:
+		return -EINVAL;
+	}
+
+	op->result = percpu_counter_read(&int_pcpu);
+	return 1;
+}
+
+/*
+ * Applies a single operation, storing its result in op->result. Returns 1
+ * if the shared value changed and has to be committed, 0 if not.
+ */
+static int intn_apply(struct intn_file *nf, struct intn_op *op)
+{
+	u32 flags = READ_ONCE(nf->flags);
+	atomic64_t *v;
+
+	if (op->index >= nr_counters)
+		return -EINVAL;
+
+	if (op->op == INTN_OP_LOAD) {
+		op->result = intn_get(op->index, flags);
+		return 0;
+	}
+
+	if (flags & INTN_F_PRIVATE) {
+		if (op->op == INTN_OP_ADD) {
+			op->result = intn_add_private(nf, op->index, op->arg);
+			return 0;
+		}
+
+		/* everything else sees the additions of the file first */
+		intn_fold(nf);
+	}
+
+	if (percpu)
+		return intn_apply_percpu(op);
+
+	v = &intn_slots[op->index].value;
+
+	switch (op->op) {
+	case INTN_OP_ADD:
+		op->result = atomic64_add_return(op->arg, v);
+		break;
+	case INTN_OP_FETCH_ADD:
+		op->result = atomic64_fetch_add(op->arg, v);
+		break;
+	case INTN_OP_CMPXCHG:
+		op->result = atomic64_cmpxchg(v, op->expected, op->arg);
+		break;
+	case INTN_OP_EXCHANGE:
+		op->result = atomic64_xchg(v, op->arg);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 1;
+}
+
+/*
+ * Sums the 64 bit delta records and adds them to counter pos / 8 as a
+ * single INTN_OP_ADD. Nothing is applied if the records can not be copied,
+ * a trailing partial record is ignored. The offset does not move, every
+ * write goes to the same counter.
+ */
+static ssize_t intn_write_delta(struct intn_file *nf, struct iov_iter *from,
+		loff_t pos)
+{
+	size_t size = round_down(iov_iter_count(from), sizeof(s64));
+	s64 deltas[INTN_BIN_CHUNK];
+	struct intn_op op = {
+		.op = INTN_OP_ADD,
+	};
+	size_t done, n, i;
+	int ret;
+
+	if (pos < 0 || pos % sizeof(s64))
+		return -EINVAL;
+
+	if (pos >= (loff_t)nr_counters * sizeof(s64))
+		return -ENOSPC;
+
+	if (!size)
+		return -EINVAL;
+
+	for (done = 0; done < size; done += n) {
+		n = min(size - done, sizeof(deltas));
+
+		if (!copy_from_iter_full(deltas, n, from))
+			return -EFAULT;
+
+		for (i = 0; i < n / sizeof(s64); i++)
+			op.arg += deltas[i];
+
+		cond_resched();
 	}
+
+	op.index = pos / sizeof(s64);
+	ret = intn_apply(nf, &op);
+
+	if (ret < 0)
+		return ret;
+
+	if (ret)
+		intn_commit(op.index);
+
+	WRITE_ONCE(nf->result, op.result);
+	return size;
 }
 
-ssize_t intn_write(struct file *f, const char __user *u, size_t size, loff_t *l)
+/*
+ * Takes the value as text, as binary values or as binary deltas depending
+ * on the file flags.
+ */
+static ssize_t __intn_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+	struct file *f = iocb->ki_filp;
+	struct intn_file *nf = f->private_data;
+	u32 flags = READ_ONCE(nf->flags);
+	size_t size = iov_iter_count(from);
+	loff_t *l = &iocb->ki_pos;
 	int ret;
-	long long_tmp;
+	long long ll_tmp;
 	char ctmp[INT_LEN];
 
-	if (u == NULL)
-		return -EFAULT;
+	if (flags & INTN_F_DELTA)
+		return intn_write_delta(nf, from, *l);
+
+	if (flags & INTN_F_BINARY)
+		return intn_write_bin(nf, from, l);
+
+	if (*l < 0)
+		return -EINVAL;
+
+	if (*l >= nr_counters)
+		return -ENOSPC;
 
 	memset(ctmp, 0, INT_LEN);
 
-	/* copy the buffer from user space */
-	if (copy_from_user(&ctmp, u, INT_LEN) < 0) {
-		pr_err("Error copying buffer to userspace\n");
+	/* the whole write is one value, keeping the terminating zero */
+	if (size > INT_LEN - 1)
+		return -EINVAL;
+
+	if (copy_from_iter(ctmp, size, from) != size) {
+		pr_debug("Error copying buffer from userspace\n");
 		return -EFAULT;
-	} else {
-		/* we return the number of written bytes, always 4 */
-		pr_err("Return %lu bytes from userspace\n", strlen(ctmp));
 	}
 
-	ret = kstrtol((const char *)&ctmp, BASE10, &long_tmp);
+	ret = kstrtoll((const char *)&ctmp, BASE10, &ll_tmp);
 
+	/* -ERANGE on overflow, -EINVAL for anything else */
 	if (ret < 0) {
-		if (ret == LONG_MAX) {
-			pr_err("Overflow !\n");
-			return -ERANGE;
-		} else if (ret == LONG_MIN) {
-			pr_err("Underflow !\n");
-			return -ERANGE;
-		} else {
-			pr_err("Parsing error (invalid input)\n");
-			return -EINVAL;
+		pr_debug("Parsing error (%d)\n", ret);
+		return ret;
+	}
+
+	ret = intn_lock(f);
+
+	if (ret)
+		return ret;
+
+	intn_fold(nf);
+	intn_set(*l, ll_tmp);
+	intn_unlock();
+	intn_commit(*l);
+	pr_debug("Value stored: %lld\n", ll_tmp);
+
+	return size;
+}
+
+/* the write() and writev() file operation */
+ssize_t intn_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret;
+	int idx;
+
+	ret = intn_update_begin(&idx);
+
+	if (ret)
+		return ret;
+
+	ret = __intn_write_iter(iocb, from);
+	intn_update_end(idx);
+	return ret;
+}
+
+#define INTN_BATCH_CHUNK 16
+
+/*
+ * Copies the operations in chunks, so a batch of any size only needs a
+ * small buffer on the stack. It stops at the first invalid operation.
+ */
+static long intn_batch(struct intn_file *nf, struct intn_batch __user *ub)
+{
+	struct intn_op ops[INTN_BATCH_CHUNK];
+	struct intn_op __user *uops;
+	struct intn_batch b;
+	bool changed = false;
+	u32 idx = 0;
+	u32 done = 0;
+	u32 i, n;
+	int ret = 0;
+
+	if (copy_from_user(&b, ub, sizeof(b)))
+		return -EFAULT;
+
+	uops = u64_to_user_ptr(b.ops);
+
+	while (done < b.count) {
+		n = min_t(u32, b.count - done, INTN_BATCH_CHUNK);
+
+		if (copy_from_user(ops, uops + done, n * sizeof(*ops))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			ret = intn_apply(nf, &ops[i]);
+
+			if (ret < 0)
+				break;
+
+			if (ret && changed && ops[i].index != idx)
+				idx = INTN_COMMIT_ALL;
+			else if (ret && !changed)
+				idx = ops[i].index;
+
+			changed |= ret;
+		}
+
+		if (copy_to_user(uops + done, ops, i * sizeof(*ops)))
+			ret = -EFAULT;
+		else
+			done += i;
+
+		if (ret < 0)
+			break;
+
+		cond_resched();
+	}
+
+	if (changed)
+		intn_commit(idx);
+
+	if (put_user(done, &ub->done))
+		return -EFAULT;
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Sleeps until a commit finds the condition met, the timeout expires or a
+ * signal arrives. The waiter is on the stack, if it is still on the list
+ * it is taken off, if a commit already took it the completion is waited
+ * for.
+ */
+static long intn_wait(struct intn_wait __user *uw)
+{
+	struct intn_waiter w = {};
+	struct intn_wait wt;
+	ktime_t expires;
+	long ret = 0;
+
+	if (copy_from_user(&wt, uw, sizeof(wt)))
+		return -EFAULT;
+
+	if (wt.index >= nr_counters || wt.cond >= INTN_NR_WAIT)
+		return -EINVAL;
+
+	INIT_LIST_HEAD(&w.node);
+	w.index = wt.index;
+	w.cond = wt.cond;
+	w.val = wt.val;
+	w.task = current;
+	/* saturates, so a huge timeout_ns waits forever instead of not at all */
+	expires = ktime_add_safe(ktime_get(),
+			ns_to_ktime(min_t(u64, wt.timeout_ns, KTIME_MAX)));
+	intn_add_waiter(&w, 0);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (smp_load_acquire(&w.done))
+			break;
+
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
 		}
+
+		if (!schedule_hrtimeout(wt.timeout_ns ? &expires : NULL,
+					HRTIMER_MODE_ABS)) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+	}
+
+	__set_current_state(TASK_RUNNING);
+
+	if (ret) {
+		spin_lock_irq(&w.bucket->lock);
+
+		if (!list_empty(&w.node)) {
+			__intn_unlink_waiter(&w);
+			spin_unlock_irq(&w.bucket->lock);
+			return ret;
+		}
+
+		spin_unlock_irq(&w.bucket->lock);
+
+		/* a commit took it meanwhile, the condition was met */
+		for (;;) {
+			set_current_state(TASK_UNINTERRUPTIBLE);
+
+			if (smp_load_acquire(&w.done))
+				break;
+
+			schedule();
+		}
+
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return put_user(w.result, &uw->result);
+}
+
+static long __intn_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	struct intn_file *nf = f->private_data;
+	struct intn_op __user *uop = (void __user *)arg;
+	u32 flags = READ_ONCE(nf->flags);
+	struct intn_op op;
+	int ret;
+
+	switch (cmd) {
+	case INTN_IOC_ADD:
+		op.op = INTN_OP_ADD;
+		break;
+	case INTN_IOC_FETCH_ADD:
+		op.op = INTN_OP_FETCH_ADD;
+		break;
+	case INTN_IOC_CMPXCHG:
+		op.op = INTN_OP_CMPXCHG;
+		break;
+	case INTN_IOC_EXCHANGE:
+		op.op = INTN_OP_EXCHANGE;
+		break;
+	case INTN_IOC_BATCH:
+		return intn_batch(nf, (struct intn_batch __user *)arg);
+	case INTN_IOC_SET_FLAGS:
+		if (get_user(flags, (u32 __user *)arg))
+			return -EFAULT;
+
+		if (flags & ~INTN_F_ALL)
+			return -EINVAL;
+
+		WRITE_ONCE(nf->flags, flags);
+		intn_set_private(nf, flags & INTN_F_PRIVATE);
+		return 0;
+	case INTN_IOC_FLUSH:
+		intn_fold_all();
+		return 0;
+	case INTN_IOC_WAIT:
+		return intn_wait((struct intn_wait __user *)arg);
+	case INTN_IOC_GET_FLAGS:
+		return put_user(flags, (u32 __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+
+	if (get_user(op.index, &uop->index) ||
+	    get_user(op.arg, &uop->arg) ||
+	    get_user(op.expected, &uop->expected))
+		return -EFAULT;
+
+	ret = intn_apply(nf, &op);
+
+	if (ret < 0)
+		return ret;
+
+	if (ret)
+		intn_commit(op.index);
+
+	return put_user(op.result, &uop->result);
+}
+
+static long intn_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	long ret;
+	int idx;
+
+	/* waits and flag reads do not change anything, they pass a freeze */
+	if (cmd == INTN_IOC_WAIT || cmd == INTN_IOC_GET_FLAGS)
+		return __intn_ioctl(f, cmd, arg);
+
+	ret = intn_update_begin(&idx);
+
+	if (ret)
+		return ret;
+
+	ret = __intn_ioctl(f, cmd, arg);
+	intn_update_end(idx);
+	return ret;
+}
+
+/* queues a waiter, completed by a commit or its timeout */
+static int intn_uring_wait(struct io_uring_cmd *ioucmd,
+		const struct intn_uring_cmd *c, unsigned int issue_flags)
+{
+	u64 max_ns = (u64)READ_ONCE(wait_max_ms) * NSEC_PER_MSEC;
+	u64 timeout = c->timeout_ns;
+	struct intn_waiter *w;
+
+	if (c->cond >= INTN_NR_WAIT)
+		return -EINVAL;
+
+	w = kzalloc(sizeof(*w), issue_flags & IO_URING_F_NONBLOCK ?
+			GFP_NOWAIT : GFP_KERNEL);
+
+	if (!w)
+		return issue_flags & IO_URING_F_NONBLOCK ? -EAGAIN : -ENOMEM;
+
+	/* a ring can only be torn down once every wait ended */
+	if (!timeout || timeout > max_ns)
+		timeout = max_ns;
+
+	INIT_LIST_HEAD(&w->node);
+	w->index = c->index;
+	w->cond = c->cond;
+	w->val = c->arg;
+	w->ioucmd = ioucmd;
+	intn_uring_pdu(ioucmd)->w = w;
+	hrtimer_init(&w->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	w->timer.function = intn_waiter_timeout;
+
+	intn_add_waiter(w, timeout);
+	return -EIOCBQUEUED;
+}
+
+/*
+ * Runs an IORING_OP_URING_CMD. sqe->cmd_op is the operation and the SQE
+ * command bytes hold a struct intn_uring_cmd, the result goes to the
+ * extra CQE field. The SQE stays shared with user space, so it is copied
+ * once before it is looked at.
+ */
+static int intn_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct intn_file *nf = ioucmd->file->private_data;
+	struct intn_uring_cmd c;
+	struct intn_op op;
+	int ret, idx;
+
+	if ((issue_flags & (IO_URING_F_SQE128 | IO_URING_F_CQE32)) !=
+			(IO_URING_F_SQE128 | IO_URING_F_CQE32))
+		return -EINVAL;
+
+	memcpy(&c, ioucmd->cmd, sizeof(c));
+
+	if (c.index >= nr_counters)
+		return -EINVAL;
+
+	if (ioucmd->cmd_op == INTN_OP_WAIT)
+		return intn_uring_wait(ioucmd, &c, issue_flags);
+
+	op.op = ioucmd->cmd_op;
+	op.index = c.index;
+	op.arg = c.arg;
+	op.expected = c.expected;
+	op.result = 0;
+	ret = intn_update_begin(&idx);
+
+	if (!ret) {
+		ret = intn_apply(nf, &op);
+		intn_update_end(idx);
 	}
 
-	int_value = (int)long_tmp;
-	pr_err("Value stored: %d\n", int_value);
+	if (ret > 0)
+		intn_commit(op.index);
+
+	io_uring_cmd_done(ioucmd, ret < 0 ? ret : 0, op.result);
+	return -EIOCBQUEUED;
+}
+
+static __poll_t intn_poll(struct file *f, poll_table *wait)
+{
+	struct intn_file *nf = f->private_data;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(f, &intn_poll_wq, wait);
+
+	/*
+	 * Queued before the version is checked, pairs with the increment in
+	 * intn_commit(): either the commit sees the waiter or the poller sees
+	 * the new version.
+	 */
+	smp_mb();
+
+	if (atomic64_read(&intn_version) != READ_ONCE(nf->seen))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
+
+static void intn_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&intn_page_maps);
+}
+
+static void intn_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&intn_page_maps);
+}
+
+static const struct vm_operations_struct intn_vm_ops = {
+	.open  = intn_vm_open,
+	.close = intn_vm_close,
+};
+
+/* maps the read only struct intn_page, one page at offset 0 */
+static int intn_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
 
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	ret = vm_insert_page(vma, vma->vm_start, virt_to_page(intn_page));
+
+	if (ret)
+		return ret;
+
+	vma->vm_ops = &intn_vm_ops;
+	intn_vm_open(vma);
+
+	/* the page is stale while it was not mapped */
+	intn_commit(0);
 	return 0;
 }
 
+/*
+ * The mutex is only held during read() and write(), so any number of
+ * processes can keep the device open at the same time.
+ */
 int intn_release(struct inode *inode, struct file *filp)
 {
-	mutex_unlock(&intn->intn_mutex);
+	struct intn_file *nf = filp->private_data;
+
+	intn_set_private(nf, false);
+	kfree(nf);
+	return 0;
+}
+
+/*
+ * The kernels this builds on can not cancel a uring command, a ring being
+ * torn down waits for the pending ones. The waits queued on a file end
+ * with -ECANCELED when the file is closed, so closing the device before
+ * the ring does not wait for up to wait_max_ms.
+ */
+static int intn_flush(struct file *f, fl_owner_t id)
+{
+	struct intn_wait_bucket *b;
+	struct intn_waiter *w, *tmp;
+	LIST_HEAD(cancelled);
+	int i;
+
+	if (!atomic_read(&intn_nr_waiters))
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(intn_wait_table); i++) {
+		b = &intn_wait_table[i];
+
+		if (!atomic_read(&b->nr))
+			continue;
+
+		spin_lock_irq(&b->lock);
+
+		list_for_each_entry_safe(w, tmp, &b->waiters, node) {
+			if (!w->ioucmd || w->ioucmd->file != f)
+				continue;
+
+			__intn_unlink_waiter(w);
+			list_add_tail(&w->woken, &cancelled);
+		}
+
+		spin_unlock_irq(&b->lock);
+	}
+
+	list_for_each_entry_safe(w, tmp, &cancelled, woken) {
+		hrtimer_cancel(&w->timer);
+		intn_waiter_done(w, -ECANCELED);
+	}
+
+	return 0;
+}
+
+/* folds what a private file has pending, there is nothing else to sync */
+static int intn_fsync(struct file *f, loff_t start, loff_t end, int datasync)
+{
+	intn_fold(f->private_data);
 	return 0;
 }
 
 
 int intn_open(struct inode *inode, struct file *filp)
 {
-	mutex_lock(&intn->intn_mutex);
+	struct intn_file *nf;
+
+	nf = kzalloc(sizeof(*nf), GFP_KERNEL);
+
+	if (!nf)
+		return -ENOMEM;
+
+	nf->seen = atomic64_read(&intn_version);
+	spin_lock_init(&nf->lock);
+	INIT_LIST_HEAD(&nf->node);
+	filp->private_data = nf;
 	return 0;
 }
 
@@ -133,8 +1731,16 @@ int intn_open(struct inode *inode, struct file *filp)
  */
 static const struct file_operations intn_fops = {
 	.owner   = THIS_MODULE,
+	.llseek  = no_seek_end_llseek,
 	.read    = intn_read,
-	.write   = intn_write,
+	.write_iter = intn_write_iter,
+	.unlocked_ioctl = intn_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.uring_cmd      = intn_uring_cmd,
+	.poll    = intn_poll,
+	.mmap    = intn_mmap,
+	.fsync   = intn_fsync,
+	.flush   = intn_flush,
 	.open    = intn_open,
 	.release = intn_release,
 };
@@ -154,7 +1760,13 @@ void intn_cleanup(void)
 	if (intn->intn_class)
 		class_destroy(intn->intn_class);
 
+	debugfs_remove_recursive(intn->intn_debugfs);
+	kvfree(intn_handoff_in);
+	free_percpu(intn->intn_lstats);
 	kfree(intn);
+	percpu_counter_destroy(&int_pcpu);
+	free_page((unsigned long)intn_page);
+	vfree(intn_slots);
 	unregister_chrdev_region(dev, NR_DEVS);
 }
 
@@ -172,8 +1784,20 @@ static int __init intn_init(void)
 	int ret;
 	int err;
 	int devno;
+	int i;
 	dev_t dev;
 
+	if (batch <= 0) {
+		pr_err("invalid batch %d\n", batch);
+		return -EINVAL;
+	}
+
+	if (nr_counters < 1 || nr_counters > MAX_COUNTERS ||
+	    (percpu && nr_counters > 1)) {
+		pr_err("invalid nr_counters %d\n", nr_counters);
+		return -EINVAL;
+	}
+
 	intn = kzalloc(sizeof(struct intn_dev), GFP_KERNEL);
 
 	if (!intn) {
@@ -217,6 +1841,64 @@ static int __init intn_init(void)
 	/* Mutex must be initialized  before the device is allocated */
 	mutex_init(&intn->intn_mutex);
 
+	intn->intn_lstats = alloc_percpu(struct intn_lock_stats);
+
+	if (!intn->intn_lstats) {
+		pr_err("Error allocating the lock statistics\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	if (percpu) {
+		ret = percpu_counter_init(&int_pcpu, INIT_VALUE, GFP_KERNEL);
+
+		if (ret) {
+			pr_err("Error allocating the per-CPU counter\n");
+			goto fail;
+		}
+	}
+
+	intn_slots = vzalloc(array_size(nr_counters, sizeof(*intn_slots)));
+
+	if (!intn_slots) {
+		pr_err("Error allocating %d counters\n", nr_counters);
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < nr_counters; i++)
+		atomic64_set(&intn_slots[i].value, INIT_VALUE);
+
+	for (i = 0; i < ARRAY_SIZE(intn_wait_table); i++) {
+		spin_lock_init(&intn_wait_table[i].lock);
+		INIT_LIST_HEAD(&intn_wait_table[i].waiters);
+	}
+
+	intn_page = (struct intn_page *)get_zeroed_page(GFP_KERNEL);
+
+	if (!intn_page) {
+		pr_err("Error allocating the mapped page\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	if (restore) {
+		intn_frozen_ns = ktime_get_ns();
+		intn_state = INTN_EMPTY;
+	}
+
+	/*
+	 * debugfs is optional, errors are ignored. Its files reach the
+	 * counters, so they only show up once those are allocated.
+	 */
+	intn->intn_debugfs = debugfs_create_dir(DEVNAME, NULL);
+	debugfs_create_file("lock_stats", 0600, intn->intn_debugfs, NULL,
+			&intn_lock_stats_fops);
+	debugfs_create_file("handoff", 0600, intn->intn_debugfs, NULL,
+			&intn_handoff_fops);
+	debugfs_create_u64("downtime_ns", 0400, intn->intn_debugfs,
+			&intn_downtime_ns);
+
 	/* char device registration */
 	devno = MKDEV(intn_major, intn_minor);
 	cdev_init(&intn->intn_cdev, &intn_fops);
@@ -230,9 +1912,6 @@ static int __init intn_init(void)
 		goto fail;
 	}
 
-	memset(cint, 0, INT_LEN);
-	int_value = INIT_VALUE;
-
 	return 0;
 fail:
 	intn_cleanup();
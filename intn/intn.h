@@ -0,0 +1,193 @@
+/*
+ * /dev/intn driver interface
+ *
+ * Copyright (C) 2014 Rafael do Nascimento Pereira <rnp@25ghz.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * ioctl commands shared by the intn driver and the userspace programs
+ * using it.
+ */
+
+#ifndef _INTN_H
+#define _INTN_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * operations on the counter, every one of them is atomic. With the percpu
+ * module parameter set only INTN_OP_LOAD and INTN_OP_ADD are supported,
+ * and the result of INTN_OP_ADD is the approximate value (INTN_F_APPROX).
+ */
+enum intn_opcode {
+	INTN_OP_LOAD,		/* result = value */
+	INTN_OP_ADD,		/* value += arg, result = new value */
+	INTN_OP_FETCH_ADD,	/* value += arg, result = old value */
+	INTN_OP_CMPXCHG,	/* value = arg if value == expected,
+				 * result = old value */
+	INTN_OP_EXCHANGE,	/* value = arg, result = old value */
+	INTN_OP_WAIT,		/* io_uring only: wait until the value meets
+				 * cond with arg, result = that value */
+	INTN_NR_OPS
+};
+
+enum intn_wait_cond {
+	INTN_WAIT_GE,		/* value >= arg */
+	INTN_WAIT_EQ,		/* value == arg */
+	INTN_WAIT_NE,		/* value != arg */
+	INTN_NR_WAIT
+};
+
+struct intn_op {
+	__u32 op;		/* enum intn_opcode, only used by batches */
+	__u32 index;		/* counter, below nr_counters */
+	__s64 arg;
+	__s64 expected;
+	__s64 result;
+};
+
+/*
+ * A batch of operations, applied in order with a single ioctl. Every
+ * operation is atomic, the batch as a whole is not. done is set to the
+ * number of operations applied, also when one of them fails.
+ */
+struct intn_batch {
+	__u64 ops;		/* pointer to count struct intn_op */
+	__u32 count;
+	__u32 done;
+};
+
+#define INTN_IOC_MAGIC      0xB2
+
+#define INTN_IOC_ADD        _IOWR(INTN_IOC_MAGIC, 1, struct intn_op)
+#define INTN_IOC_FETCH_ADD  _IOWR(INTN_IOC_MAGIC, 2, struct intn_op)
+#define INTN_IOC_CMPXCHG    _IOWR(INTN_IOC_MAGIC, 3, struct intn_op)
+#define INTN_IOC_EXCHANGE   _IOWR(INTN_IOC_MAGIC, 4, struct intn_op)
+#define INTN_IOC_BATCH      _IOWR(INTN_IOC_MAGIC, 5, struct intn_batch)
+
+/*
+ * INTN_F_APPROX: with the percpu module parameter set, reads and the
+ * result of INTN_OP_LOAD skip the fold over all CPUs, the result of
+ * INTN_OP_ADD always skips it. They are off by less than the batch module
+ * parameter times the number of CPUs. Without percpu every read is exact.
+ */
+#define INTN_F_APPROX       0x1
+
+/*
+ * INTN_F_BINARY: read() and write() move the values as an array of native
+ * __s64, counter i at offset 8 * i, instead of text. Reads honour the file
+ * offset and return 0 past the last counter. Writes start at a multiple of
+ * 8 and store whole values only, use pwrite() to pick the counter.
+ */
+#define INTN_F_BINARY       0x2
+
+/*
+ * INTN_F_PRIVATE: INTN_OP_ADD only adds to a delta kept in the open file,
+ * its result is the approximate counter plus that delta. The delta is
+ * added to the counter on fsync(), on close, when it reaches the
+ * commit_threshold module parameter, when the file adds to another
+ * counter or runs any other operation and when the flag is cleared.
+ * INTN_IOC_FLUSH adds the deltas of all the files, for an exact read.
+ */
+#define INTN_F_PRIVATE      0x4
+
+/*
+ * INTN_F_DELTA: write() and writev() take an array of __s64 deltas for
+ * counter offset / 8. All the deltas of one call are summed and added with
+ * a single atomic operation, the offset does not move. read() returns the
+ * value of the counter right after the last such addition, as an __s64,
+ * or with INTN_F_PRIVATE the value seen by the file. Overrides
+ * INTN_F_BINARY.
+ */
+#define INTN_F_DELTA        0x8
+#define INTN_F_ALL          (INTN_F_APPROX | INTN_F_BINARY | INTN_F_PRIVATE | \
+			     INTN_F_DELTA)
+
+/* set and get the INTN_F_* flags of an open file */
+#define INTN_IOC_SET_FLAGS  _IOW(INTN_IOC_MAGIC, 6, __u32)
+#define INTN_IOC_GET_FLAGS  _IOR(INTN_IOC_MAGIC, 7, __u32)
+
+/* fold the pending deltas of all the INTN_F_PRIVATE files */
+#define INTN_IOC_FLUSH      _IO(INTN_IOC_MAGIC, 8)
+
+/*
+ * Sleep until counter index meets cond with val, result is the value that
+ * did. Fails with ETIMEDOUT after timeout_ns, unless it is 0, and with
+ * EINTR on a signal. Deltas still pending in INTN_F_PRIVATE files are not
+ * part of the value.
+ */
+struct intn_wait {
+	__u32 index;
+	__u32 cond;		/* enum intn_wait_cond */
+	__s64 val;
+	__u64 timeout_ns;
+	__s64 result;
+};
+
+#define INTN_IOC_WAIT       _IOWR(INTN_IOC_MAGIC, 9, struct intn_wait)
+
+/*
+ * The io_uring interface: IORING_OP_URING_CMD with sqe->cmd_op set to an
+ * enum intn_opcode and this structure in the command bytes of the SQE. The
+ * ring needs IORING_SETUP_SQE128 and IORING_SETUP_CQE32, cqe->res is 0 or
+ * -errno and cqe->big_cqe[0] the result. A wait fails with -ETIME after
+ * timeout_ns, or after the wait_max_ms module parameter if that is
+ * shorter or timeout_ns is 0, and with -ECANCELED when the device file
+ * it was queued on is closed.
+ */
+struct intn_uring_cmd {
+	__u32 index;
+	__u32 cond;		/* INTN_OP_WAIT: enum intn_wait_cond */
+	__s64 arg;
+	__s64 expected;		/* INTN_OP_CMPXCHG */
+	__u64 timeout_ns;	/* INTN_OP_WAIT */
+};
+
+/*
+ * mmap() of the first page of the device, read only, starts with this
+ * structure. seq is odd while the driver updates the page, a reader
+ * retries until it sees the same even seq before and after reading the
+ * other fields (see intn_page_read()). time_ns is the CLOCK_MONOTONIC
+ * time of the last update. value is counter 0. With the percpu module
+ * parameter set it is the approximate total, as read with INTN_F_APPROX.
+ */
+struct intn_page {
+	__u32 seq;
+	__u32 pad;
+	__s64 value;
+	__u64 time_ns;
+};
+
+#ifndef __KERNEL__
+static inline __s64 intn_page_read(const struct intn_page *p,
+		__u64 *time_ns)
+{
+	__u32 seq;
+	__s64 value;
+	__u64 t;
+
+	do {
+		seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+		value = __atomic_load_n(&p->value, __ATOMIC_RELAXED);
+		t = __atomic_load_n(&p->time_ns, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&p->seq,
+				__ATOMIC_RELAXED));
+
+	if (time_ns)
+		*time_ns = t;
+
+	return value;
+}
+#endif
+
+#endif /* _INTN_H */
@@ -17,6 +17,19 @@
  * user does not provide a value on the command line) threads, where each one
  * of them increments intn value by one concurrently. At the end the it is
  * expected to have a final value of X (initial) + N.
+ *
+ * The increment is a single INTN_IOC_ADD ioctl, so it is atomic and no
+ * thread can overwrite the increment of another one. It is supported with
+ * the percpu module parameter too, the value it returns is approximate
+ * then.
+ *
+ * With -e it instead checks the change notification: it waits with
+ * edge triggered epoll while another thread changes the value twice, a
+ * while apart, and expects one event for each change.
+ *
+ * With -u it checks INTN_OP_WAIT on io_uring: a wait for the next value
+ * has to complete once another thread changes it, and a wait that can not
+ * be met has to end with ECANCELED as soon as its device file is closed.
  */
 
 #include <stdio.h>
@@ -24,15 +37,24 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
 
+#include "intn.h"
+
 #define NUM_THREADS 4
-#define INT_LEN    13
+#define INT_LEN    21
 #define DEVFILE    "/dev/intn"
+#define NR_CHANGES 2
+#define CHANGE_US  200000
 
 const char *opthelp = "-h\0";
 
@@ -45,8 +67,8 @@ struct tdata {
 void *inc_devintn(void *data)
 {
 	struct tdata *t;
-	int fd, ret;
-	char myint[INT_LEN];
+	struct intn_op op;
+	int fd;
 
 	if (data == NULL)
 		return NULL;
@@ -60,34 +82,276 @@ void *inc_devintn(void *data)
 		return NULL;
 	}
 
-	memset(myint, 0, INT_LEN);
+	memset(&op, 0, sizeof(op));
+	op.arg = 1;
 
-	if (read(fd, myint, INT_LEN) < 0) {
-		printf("thread[%d]: error reading from %s (%s)\n",
+	if (ioctl(fd, INTN_IOC_ADD, &op) < 0) {
+		printf("thread[%d]: error incrementing %s (%s)\n",
 				t->tnum, DEVFILE, strerror(errno));
-		return NULL;
 	} else {
-		strncpy(t->intn, myint, INT_LEN);
-		printf("thread[%d]: value read from %s: %s\n", t->tnum, DEVFILE, t->intn);
+		snprintf(t->intn, INT_LEN, "%lld", (long long)op.result);
+		printf("thread[%d]: %s incremented to %s\n", t->tnum,
+				DEVFILE, t->intn);
 	}
 
-	int tmp = (int)strtol(myint, NULL, 10);
-	tmp++;
-	memset(myint, 0, INT_LEN);
+	close(fd);
+	pthread_exit(NULL);
+}
 
-	if ((ret = snprintf(myint, INT_LEN, "%d", tmp)) < 0) {
-		printf("thread[%d]: error converting integer (%d)\n", t->tnum, ret);
-	} else {
-		if ((ret = write(fd, myint, INT_LEN)) < 0) {
-			printf("thread[%d]: error writing (%d)\n", t->tnum, ret);
-		} else {
-			strncpy(t->intn, myint, INT_LEN);
-			printf("thread[%d]: value writen to %s: %s\n", t->tnum, DEVFILE, t->intn);
+/* changes the value NR_CHANGES times, CHANGE_US apart */
+void *change_devintn(void *data)
+{
+	struct intn_op op;
+	int fd, i;
+
+	fd = open(DEVFILE, O_RDWR);
+
+	if (fd == -1) {
+		printf("changer: error opening %s (%s)\n", DEVFILE,
+				strerror(errno));
+		return NULL;
+	}
+
+	memset(&op, 0, sizeof(op));
+	op.arg = 1;
+
+	for (i = 0; i < NR_CHANGES; i++) {
+		usleep(CHANGE_US);
+
+		if (ioctl(fd, INTN_IOC_ADD, &op) < 0)
+			printf("changer: error incrementing %s (%s)\n",
+					DEVFILE, strerror(errno));
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/* every change has to be reported, also after the first event */
+int test_epollet(void)
+{
+	struct epoll_event ev;
+	char myint[INT_LEN];
+	pthread_t changer;
+	int fd, ep, i, n;
+	int ret = -1;
+
+	fd = open(DEVFILE, O_RDONLY);
+	ep = epoll_create1(0);
+
+	if (fd == -1 || ep == -1) {
+		printf("error setting up epoll on %s (%s)\n", DEVFILE,
+				strerror(errno));
+		return -1;
+	}
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		printf("error adding %s to epoll (%s)\n", DEVFILE,
+				strerror(errno));
+		goto out;
+	}
+
+	if (pthread_create(&changer, NULL, change_devintn, NULL)) {
+		printf("ERROR: could not create the changer thread\n");
+		goto out;
+	}
+
+	for (i = 0; i < NR_CHANGES; i++) {
+		n = epoll_wait(ep, &ev, 1, 10 * CHANGE_US / 1000);
+
+		if (n != 1) {
+			printf("change %d: no event (%s)\n", i,
+					n < 0 ? strerror(errno) : "timeout");
+			break;
+		}
+
+		memset(myint, 0, INT_LEN);
+
+		if (read(fd, myint, INT_LEN - 1) < 0) {
+			printf("change %d: error reading %s (%s)\n", i,
+					DEVFILE, strerror(errno));
+			break;
 		}
+
+		printf("change %d: event, value %s\n", i, myint);
 	}
 
+	pthread_join(changer, NULL);
+
+	if (i == NR_CHANGES) {
+		printf("epoll EPOLLET: OK\n");
+		ret = 0;
+	}
+out:
+	close(ep);
 	close(fd);
-	pthread_exit(NULL);
+	return ret;
+}
+
+/* an io_uring with 128 byte SQEs and 32 byte CQEs, set up by hand */
+struct ring {
+	int fd;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	char *sqes;
+	char *cqes;
+};
+
+int ring_init(struct ring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+
+	if (r->fd < 0)
+		return -1;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes +
+		p.cq_entries * 2 * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+
+	if (sq == MAP_FAILED)
+		return -1;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd,
+				IORING_OFF_CQ_RING);
+
+	if (cq == MAP_FAILED)
+		return -1;
+
+	r->sqes = mmap(NULL, p.sq_entries * 2 * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+
+	if (r->sqes == MAP_FAILED)
+		return -1;
+
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = cq + p.cq_off.cqes;
+	return 0;
+}
+
+/* submits an INTN_OP_WAIT for value >= val on fd, without waiting */
+int ring_wait(struct ring *r, int fd, int64_t val)
+{
+	struct intn_uring_cmd *cmd;
+	struct io_uring_sqe *sqe;
+	unsigned int tail, slot;
+
+	tail = *r->sq_tail;
+	slot = tail & *r->sq_mask;
+	sqe = (struct io_uring_sqe *)(r->sqes + slot * 128);
+	memset(sqe, 0, 128);
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = INTN_OP_WAIT;
+	cmd = (struct intn_uring_cmd *)sqe->cmd;
+	cmd->cond = INTN_WAIT_GE;
+	cmd->arg = val;
+	r->sq_array[slot] = slot;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) == 1 ?
+		0 : -1;
+}
+
+/* waits for the next completion, returns its res and stores its result */
+int ring_reap(struct ring *r, int64_t *result)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int res;
+
+	head = *r->cq_head;
+
+	while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		if (syscall(__NR_io_uring_enter, r->fd, 0, 1,
+					IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+				errno != EINTR)
+			return -errno;
+
+	cqe = (struct io_uring_cqe *)(r->cqes + (head & *r->cq_mask) * 32);
+	res = cqe->res;
+	*result = cqe->big_cqe[0];
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return res;
+}
+
+/* a wait completes on a change, and is cancelled when its file is closed */
+int test_uring_wait(void)
+{
+	struct intn_op op;
+	pthread_t changer;
+	int64_t result;
+	struct ring r;
+	int fd, res;
+
+	fd = open(DEVFILE, O_RDWR);
+
+	if (fd == -1 || ring_init(&r, 4)) {
+		printf("error setting up io_uring on %s (%s)\n", DEVFILE,
+				strerror(errno));
+		return -1;
+	}
+
+	memset(&op, 0, sizeof(op));
+
+	if (ioctl(fd, INTN_IOC_ADD, &op) < 0 ||
+			ring_wait(&r, fd, op.result + 1) ||
+			pthread_create(&changer, NULL, change_devintn, NULL)) {
+		printf("error queueing the wait (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	res = ring_reap(&r, &result);
+	pthread_join(changer, NULL);
+
+	if (res) {
+		printf("wait: failed (%s)\n", strerror(-res));
+		return -1;
+	}
+
+	printf("wait: woken at %lld\n", (long long)result);
+
+	if (ring_wait(&r, fd, INT64_MAX)) {
+		printf("error queueing the wait (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	close(fd);
+	res = ring_reap(&r, &result);
+
+	if (res != -ECANCELED) {
+		printf("close: wait ended with %s instead of ECANCELED\n",
+				res ? strerror(-res) : "success");
+		return -1;
+	}
+
+	close(r.fd);
+	printf("io_uring wait: OK\n");
+	return 0;
 }
 
 void help(void)
@@ -98,6 +362,8 @@ void help(void)
 		"test_intn <thread_number>\n"
 		"  <thread_number>:  concurrent threads accessing /dev/intn\n"
 		"                    if not specified default to 4 threads.\n"
+		"  -e                check edge triggered epoll notification\n"
+		"  -u                check INTN_OP_WAIT on io_uring\n"
 		"  -h                show this help message\n");
 }
 
@@ -110,6 +376,10 @@ int main(int argc, const char *argv[])
 		if (!strncmp(argv[1], opthelp, strlen(opthelp))) {
 			help();
 			return 0;
+		} else if (!strcmp(argv[1], "-e")) {
+			return test_epollet();
+		} else if (!strcmp(argv[1], "-u")) {
+			return test_uring_wait();
 		} else if (atoi(argv[1]) > 0) {
 			nthreads = (uint32_t)atoi(argv[1]);
 			printf("Number of threads: %u\n", nthreads);
@@ -17,6 +17,31 @@
  * the user to pass an integer as an parameter, for the internal counter.
  * Otherwise, this driver implements the same functionality and its
  * predecessor.
+ *
+ * The mutex is held from open() to close(). /sys/kernel/debug/intn2/
+ * lock_stats shows how long it was waited for and held, as log2
+ * histograms in ns kept per CPU. Writing anything to it resets them.
+ *
+ * /sys/kernel/debug/intn2/handoff carries the counter over a reload of
+ * the driver: reading it freezes the counter and returns its state,
+ * loading the new driver with restore=1 and writing the state back to it
+ * resumes it. Writes fail with -EAGAIN in between, downtime_ns tells how
+ * long that took. "make reload" does the whole sequence.
+ *
+ * The second minor, /dev/intn2_rate, reads how much the counter changed
+ * per second over the last 1, 10 and 60 seconds. Writes count the change
+ * in per-CPU rings of one second buckets, only a read of the rates sums
+ * them.
+ *
+ * Loaded with hist=1 /dev/intn2 aggregates latency samples instead of
+ * holding the counter. Writes take native 64 bit ns values, as many as
+ * fit in the write()/writev(), and record them in per-CPU log-linear
+ * histograms without taking the mutex. Reads merge them and return the
+ * count, mean, max, p50, p99 and p999 followed by the non-empty buckets.
+ * Writing anything to /sys/kernel/debug/intn2/hist_reset clears them.
+ * The counter is out of reach in this mode: the handoff carries the value
+ * it was loaded with, /dev/intn2_rate reads 0 and lock_stats stays empty,
+ * as nothing takes the mutex. The histograms do not survive a reload.
  */
 
 #include <linux/init.h>
@@ -29,11 +54,24 @@
 #include <linux/slab.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/sched/clock.h>
+#include <linux/srcu.h>
+#include <linux/timekeeping.h>
+#include <linux/math64.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/cpu.h>
+#include <linux/smp.h>
 
 
 #define DEVNAME     "intn2"
 #define CLASSNAME   "dummy2"
-#define NR_DEVS     1
+#define NR_DEVS     2
+#define RATE_MINOR  1
 #define INIT_VALUE  25
 #define INT_LEN     12
 #define BASE10      10
@@ -44,11 +82,65 @@ static int intn2_minor;
 static int counter = 25;
 static char cint[INT_LEN];
 
+/*
+ * Change of the counter per second of CLOCK_MONOTONIC, bucket sec %
+ * RATE_BUCKETS. The first write of a new second resets the bucket it maps
+ * to, readers skip the buckets of other seconds. A reader racing with the
+ * reset may miss or count twice the last changes of a CPU, rates are not
+ * exact anyway.
+ */
+#define RATE_BUCKETS 64		/* 60 seconds and the current one */
+
+struct intn2_rate {
+	u64 sec[RATE_BUCKETS];
+	s64 delta[RATE_BUCKETS];
+};
+
+static const unsigned int rate_windows[] = { 1, 10, 60 };
+
+#define NR_WINDOWS  ARRAY_SIZE(rate_windows)
+#define RATE_LEN    (NR_WINDOWS * 24)
+
+/*
+ * Log-linear histogram: values below 2^HIST_SUB_BITS have a bucket each,
+ * every power of two above is split in 2^HIST_SUB_BITS buckets, so a
+ * bucket is at most 1/32 of its value wide.
+ */
+#define HIST_SUB_BITS  5
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS   ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define HIST_CHUNK     32
+
+struct intn2_hist {
+	u64 count;
+	u64 sum;
+	u64 max;
+	u64 buckets[HIST_BUCKETS];
+};
+
+/* bucket i counts the times in [2^i, 2^(i+1)) ns, the last one the rest */
+#define LOCK_HIST_BUCKETS 32
+
+struct intn2_lock_stats {
+	u64 acquired;
+	u64 contended;		/* the mutex was held by somebody else */
+	u64 wait_max;
+	u64 hold_max;
+	u64 wait[LOCK_HIST_BUCKETS];
+	u64 hold[LOCK_HIST_BUCKETS];
+};
+
 struct intn2_dev {
 	struct cdev intn2_cdev;
 	struct class *intn2_class;
 	struct device *intn2_device;
 	struct mutex intn2_mutex;
+	u64 intn2_hold_start;	/* protected by intn2_mutex */
+	struct intn2_lock_stats __percpu *intn2_lstats;
+	struct dentry *intn2_debugfs;
+	struct device *intn2_rate_device;
+	struct intn2_rate __percpu *intn2_rates;
+	struct intn2_hist __percpu *intn2_hist;
 };
 
 struct intn2_dev *intn2 = NULL;
@@ -56,11 +148,38 @@ struct intn2_dev *intn2 = NULL;
 module_param(counter, int, 0664);
 MODULE_PARM_DESC(counter, "integer that holds the intn2 driver counter");
 
+static bool hist;
+module_param(hist, bool, 0444);
+MODULE_PARM_DESC(hist, "aggregate latency samples instead of the counter");
+
+static bool restore;
+module_param(restore, bool, 0444);
+MODULE_PARM_DESC(restore,
+		"start frozen, waiting for the handoff of the last driver");
+
+/*
+ * Reading the handoff freezes the counter, writes fail with -EAGAIN until
+ * a handoff is written back. Loaded with restore=1 the driver starts
+ * empty, reads fail as well until then. Writes run in an intn2_srcu read
+ * section, so the freeze can wait for those which did not see it.
+ */
+enum intn2_state {
+	INTN2_LIVE,
+	INTN2_FROZEN,
+	INTN2_EMPTY,
+};
+
+static int intn2_state = INTN2_LIVE;
+DEFINE_STATIC_SRCU(intn2_srcu);
+
 ssize_t intn2_read(struct file *f, char __user *u, size_t size, loff_t *l)
 {
 	if (u == NULL)
 		return -EFAULT;
 
+	if (READ_ONCE(intn2_state) == INTN2_EMPTY)
+		return -EAGAIN;
+
 	if (snprintf(cint, INT_LEN, "%d\n", counter) < 0) {
 		pr_err("Error converting, returning default value\n");
 		if (!strncpy(cint, DEFAULT_INT, 3))
@@ -79,10 +198,35 @@ ssize_t intn2_read(struct file *f, char __user *u, size_t size, loff_t *l)
 	}
 }
 
+static u64 intn2_now_sec(void)
+{
+	return div_u64(ktime_get_coarse_ns(), NSEC_PER_SEC);
+}
+
+/* counts a change of the counter in the current second of this CPU */
+static void intn2_rate_add(s64 delta)
+{
+	u64 sec = intn2_now_sec();
+	unsigned int b = sec % RATE_BUCKETS;
+	struct intn2_rate *r;
+
+	r = get_cpu_ptr(intn2->intn2_rates);
+
+	if (r->sec[b] != sec) {
+		WRITE_ONCE(r->delta[b], 0);
+		WRITE_ONCE(r->sec[b], sec);
+	}
+
+	WRITE_ONCE(r->delta[b], r->delta[b] + delta);
+	put_cpu_ptr(intn2->intn2_rates);
+}
+
 ssize_t intn2_write(struct file *f, const char __user *u, size_t size,
 		loff_t *l)
 {
 	int ret;
+	int idx;
+	int old;
 	long long_tmp;
 	char ctmp[INT_LEN];
 
@@ -116,25 +260,469 @@ ssize_t intn2_write(struct file *f, const char __user *u, size_t size,
 		}
 	}
 
+	idx = srcu_read_lock(&intn2_srcu);
+
+	if (READ_ONCE(intn2_state) != INTN2_LIVE) {
+		srcu_read_unlock(&intn2_srcu, idx);
+		return -EAGAIN;
+	}
+
+	old = counter;
 	counter = (int)long_tmp;
+	srcu_read_unlock(&intn2_srcu, idx);
+	intn2_rate_add((s64)(int)long_tmp - old);
 	pr_err("Value stored: %d\n", counter);
 
 	return size;
 }
 
+static unsigned int intn2_lock_bucket(u64 ns)
+{
+	return ns ? min_t(unsigned int, ilog2(ns), LOCK_HIST_BUCKETS - 1) : 0;
+}
+
 int intn2_release(struct inode *inode, struct file *filp)
 {
+	struct intn2_lock_stats *st;
+	u64 ns = local_clock() - intn2->intn2_hold_start;
+
 	mutex_unlock(&intn2->intn2_mutex);
+
+	st = get_cpu_ptr(intn2->intn2_lstats);
+	st->hold[intn2_lock_bucket(ns)]++;
+	st->hold_max = max(st->hold_max, ns);
+	put_cpu_ptr(intn2->intn2_lstats);
+	return 0;
+}
+
+
+/*
+ * Sums the buckets of the seconds completed within every window, the
+ * current second is left out until it is over.
+ */
+static void intn2_rate_sum(s64 *sums)
+{
+	u64 now = intn2_now_sec();
+	u64 oldest = rate_windows[NR_WINDOWS - 1];
+	struct intn2_rate *r;
+	u64 sec;
+	s64 delta;
+	int cpu, b, i;
+
+	memset(sums, 0, NR_WINDOWS * sizeof(*sums));
+
+	for_each_possible_cpu(cpu) {
+		r = per_cpu_ptr(intn2->intn2_rates, cpu);
+
+		for (b = 0; b < RATE_BUCKETS; b++) {
+			sec = READ_ONCE(r->sec[b]);
+
+			if (sec >= now || now - sec > oldest)
+				continue;
+
+			delta = READ_ONCE(r->delta[b]);
+
+			for (i = 0; i < NR_WINDOWS; i++)
+				if (now - sec <= rate_windows[i])
+					sums[i] += delta;
+		}
+	}
+}
+
+/* one "<window>s <change per second>" line per window */
+static ssize_t intn2_rate_read(struct file *f, char __user *u, size_t size,
+		loff_t *l)
+{
+	s64 sums[NR_WINDOWS];
+	char buf[RATE_LEN];
+	int len = 0;
+	int i;
+
+	intn2_rate_sum(sums);
+
+	for (i = 0; i < NR_WINDOWS; i++)
+		len += scnprintf(buf + len, RATE_LEN - len, "%us %lld\n",
+				rate_windows[i],
+				div_s64(sums[i], rate_windows[i]));
+
+	return simple_read_from_buffer(u, size, l, buf, len);
+}
+
+/* the rate minor does not take the mutex, it never blocks the counter */
+static const struct file_operations intn2_rate_fops = {
+	.owner   = THIS_MODULE,
+	.read    = intn2_rate_read,
+	.llseek  = default_llseek,
+};
+
+static unsigned int intn2_hist_bucket(u64 v)
+{
+	unsigned int shift;
+
+	if (v < HIST_SUB)
+		return v;
+
+	shift = fls64(v) - 1 - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + (v >> shift) - HIST_SUB;
+}
+
+/* the lowest and highest value of bucket i */
+static u64 intn2_hist_low(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < HIST_SUB)
+		return i;
+
+	shift = (i >> HIST_SUB_BITS) - 1;
+	return (u64)((i & (HIST_SUB - 1)) + HIST_SUB) << shift;
+}
+
+static u64 intn2_hist_high(unsigned int i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	return intn2_hist_low(i) + (1ULL << ((i >> HIST_SUB_BITS) - 1)) - 1;
+}
+
+/*
+ * Records the samples of a write()/writev() on this CPU. They are copied
+ * in chunks and interrupts are only off while a chunk is recorded, so a
+ * reset never sees half of one. A write ending in a partial sample fails
+ * before anything is recorded.
+ */
+static ssize_t intn2_hist_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	size_t size = iov_iter_count(from);
+	u64 samples[HIST_CHUNK];
+	struct intn2_hist *h;
+	unsigned long flags;
+	size_t done = 0;
+	size_t n, i;
+
+	if (size % sizeof(u64))
+		return -EINVAL;
+
+	while (done < size) {
+		n = min_t(size_t, size - done, sizeof(samples));
+
+		if (!copy_from_iter_full(samples, n, from))
+			return done ? done : -EFAULT;
+
+		local_irq_save(flags);
+		h = this_cpu_ptr(intn2->intn2_hist);
+
+		for (i = 0; i < n / sizeof(u64); i++) {
+			h->buckets[intn2_hist_bucket(samples[i])]++;
+			h->sum += samples[i];
+			h->max = max(h->max, samples[i]);
+		}
+
+		h->count += n / sizeof(u64);
+		local_irq_restore(flags);
+		done += n;
+	}
+
+	return done;
+}
+
+/* the highest value of the bucket holding the sample of rank count * pm */
+static u64 intn2_hist_pct(const struct intn2_hist *h, unsigned int pm)
+{
+	u64 rank = div_u64(h->count * pm + 999, 1000);
+	u64 seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+
+		if (seen >= rank)
+			return min(intn2_hist_high(i), h->max);
+	}
+
+	return h->max;
+}
+
+/*
+ * Merges the per-CPU histograms. Samples being recorded meanwhile may be
+ * counted in some fields and not in others.
+ */
+static int intn2_hist_show(struct seq_file *m, void *v)
+{
+	struct intn2_hist *sum, *h;
+	int cpu, i;
+
+	sum = vzalloc(sizeof(*sum));
+
+	if (!sum)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		h = per_cpu_ptr(intn2->intn2_hist, cpu);
+		sum->count += READ_ONCE(h->count);
+		sum->sum += READ_ONCE(h->sum);
+		sum->max = max(sum->max, READ_ONCE(h->max));
+
+		for (i = 0; i < HIST_BUCKETS; i++)
+			sum->buckets[i] += READ_ONCE(h->buckets[i]);
+	}
+
+	seq_printf(m, "count   %llu\n", sum->count);
+	seq_printf(m, "mean_ns %llu\n",
+			sum->count ? div64_u64(sum->sum, sum->count) : 0);
+	seq_printf(m, "max_ns  %llu\n", sum->max);
+	seq_printf(m, "p50_ns  %llu\n", intn2_hist_pct(sum, 500));
+	seq_printf(m, "p99_ns  %llu\n", intn2_hist_pct(sum, 990));
+	seq_printf(m, "p999_ns %llu\n", intn2_hist_pct(sum, 999));
+	seq_printf(m, "%-20s %-20s %12s\n", "ns>=", "ns<=", "count");
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (sum->buckets[i])
+			seq_printf(m, "%-20llu %-20llu %12llu\n",
+					intn2_hist_low(i), intn2_hist_high(i),
+					sum->buckets[i]);
+
+	vfree(sum);
 	return 0;
 }
 
+/* any number of files may be open */
+static int intn2_hist_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, intn2_hist_show, NULL);
+}
+
+static const struct file_operations intn2_hist_fops = {
+	.owner      = THIS_MODULE,
+	.open       = intn2_hist_open,
+	.read       = seq_read,
+	.write_iter = intn2_hist_write_iter,
+	.llseek     = seq_lseek,
+	.release    = single_release,
+};
 
 int intn2_open(struct inode *inode, struct file *filp)
 {
-	mutex_lock(&intn2->intn2_mutex);
+	struct intn2_lock_stats *st;
+	bool contended = false;
+	u64 start = local_clock();
+	u64 ns;
+
+	if (iminor(inode) == intn2_minor + RATE_MINOR) {
+		replace_fops(filp, &intn2_rate_fops);
+		return 0;
+	}
+
+	if (hist) {
+		replace_fops(filp, &intn2_hist_fops);
+		return intn2_hist_open(inode, filp);
+	}
+
+	if (!mutex_trylock(&intn2->intn2_mutex)) {
+		contended = true;
+		mutex_lock(&intn2->intn2_mutex);
+	}
+
+	ns = local_clock() - start;
+	st = get_cpu_ptr(intn2->intn2_lstats);
+	st->acquired++;
+	st->contended += contended;
+	st->wait[intn2_lock_bucket(ns)]++;
+	st->wait_max = max(st->wait_max, ns);
+	put_cpu_ptr(intn2->intn2_lstats);
+
+	intn2->intn2_hold_start = local_clock();
 	return 0;
 }
 
+/* sums the per-CPU lock statistics, the watermarks are the largest ones */
+static int intn2_lock_stats_show(struct seq_file *m, void *v)
+{
+	struct intn2_lock_stats sum, *st;
+	int cpu, i, last = 0;
+
+	memset(&sum, 0, sizeof(sum));
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(intn2->intn2_lstats, cpu);
+		sum.acquired += st->acquired;
+		sum.contended += st->contended;
+		sum.wait_max = max(sum.wait_max, st->wait_max);
+		sum.hold_max = max(sum.hold_max, st->hold_max);
+
+		for (i = 0; i < LOCK_HIST_BUCKETS; i++) {
+			sum.wait[i] += st->wait[i];
+			sum.hold[i] += st->hold[i];
+		}
+	}
+
+	seq_printf(m, "acquired    %llu\n", sum.acquired);
+	seq_printf(m, "contended   %llu\n", sum.contended);
+	seq_printf(m, "wait_max_ns %llu\n", sum.wait_max);
+	seq_printf(m, "hold_max_ns %llu\n", sum.hold_max);
+
+	for (i = 0; i < LOCK_HIST_BUCKETS; i++)
+		if (sum.wait[i] || sum.hold[i])
+			last = i;
+
+	seq_printf(m, "%-12s %12s %12s\n", "ns>=", "wait", "hold");
+
+	for (i = 0; i <= last; i++)
+		seq_printf(m, "%-12llu %12llu %12llu\n", i ? 1ULL << i : 0,
+				sum.wait[i], sum.hold[i]);
+
+	return 0;
+}
+
+static int intn2_lock_stats_open(struct inode *inode, struct file *f)
+{
+	return single_open(f, intn2_lock_stats_show, NULL);
+}
+
+/* any write resets the statistics, updates running meanwhile may be lost */
+static ssize_t intn2_lock_stats_write(struct file *f, const char __user *u,
+		size_t size, loff_t *l)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(intn2->intn2_lstats, cpu), 0,
+				sizeof(struct intn2_lock_stats));
+
+	return size;
+}
+
+/* runs on the CPU owning the histogram, between two recorded chunks */
+static void intn2_hist_reset_cpu(void *unused)
+{
+	memset(this_cpu_ptr(intn2->intn2_hist), 0, sizeof(struct intn2_hist));
+}
+
+/*
+ * Clears the histograms, each one on its own CPU, so no sample being
+ * recorded is lost halfway. A read meanwhile may merge cleared and not
+ * yet cleared CPUs.
+ */
+static ssize_t intn2_hist_reset_write(struct file *f, const char __user *u,
+		size_t size, loff_t *l)
+{
+	int cpu;
+
+	cpus_read_lock();
+
+	for_each_possible_cpu(cpu)
+		if (!cpu_online(cpu))
+			memset(per_cpu_ptr(intn2->intn2_hist, cpu), 0,
+					sizeof(struct intn2_hist));
+
+	on_each_cpu(intn2_hist_reset_cpu, NULL, 1);
+	cpus_read_unlock();
+	return size;
+}
+
+static const struct file_operations intn2_hist_reset_fops = {
+	.owner   = THIS_MODULE,
+	.open    = simple_open,
+	.write   = intn2_hist_reset_write,
+	.llseek  = noop_llseek,
+};
+
+static const struct file_operations intn2_lock_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = intn2_lock_stats_open,
+	.read    = seq_read,
+	.write   = intn2_lock_stats_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+#define INTN2_HANDOFF_MAGIC 0x324e544e	/* "NTN2" */
+
+/*
+ * The state carried from one instance of the driver to the next one.
+ * frozen_ns is the CLOCK_MONOTONIC time of the freeze, the downtime is
+ * measured from it.
+ */
+struct intn2_handoff {
+	u32 magic;
+	s32 counter;
+	u64 frozen_ns;
+};
+
+static DEFINE_MUTEX(intn2_handoff_lock);
+static u64 intn2_frozen_ns;
+static u64 intn2_downtime_ns;
+
+/* freezes the counter and returns its state */
+static ssize_t intn2_handoff_read(struct file *f, char __user *u,
+		size_t size, loff_t *l)
+{
+	struct intn2_handoff h;
+
+	mutex_lock(&intn2_handoff_lock);
+
+	if (READ_ONCE(intn2_state) == INTN2_EMPTY) {
+		mutex_unlock(&intn2_handoff_lock);
+		return -EAGAIN;
+	}
+
+	if (READ_ONCE(intn2_state) == INTN2_LIVE) {
+		intn2_frozen_ns = ktime_get_ns();
+		WRITE_ONCE(intn2_state, INTN2_FROZEN);
+		synchronize_srcu(&intn2_srcu);
+	}
+
+	h.magic = INTN2_HANDOFF_MAGIC;
+	h.counter = READ_ONCE(counter);
+	h.frozen_ns = intn2_frozen_ns;
+	mutex_unlock(&intn2_handoff_lock);
+
+	return simple_read_from_buffer(u, size, l, &h, sizeof(h));
+}
+
+/* takes the state of the last instance and lets the writes run again */
+static ssize_t intn2_handoff_write(struct file *f, const char __user *u,
+		size_t size, loff_t *l)
+{
+	struct intn2_handoff h;
+
+	if (*l || size != sizeof(h))
+		return -EINVAL;
+
+	if (copy_from_user(&h, u, sizeof(h)))
+		return -EFAULT;
+
+	if (h.magic != INTN2_HANDOFF_MAGIC) {
+		pr_err("invalid handoff\n");
+		return -EINVAL;
+	}
+
+	mutex_lock(&intn2_handoff_lock);
+
+	if (READ_ONCE(intn2_state) == INTN2_LIVE) {
+		mutex_unlock(&intn2_handoff_lock);
+		pr_err("handoff written while the counter is live\n");
+		return -EBUSY;
+	}
+
+	WRITE_ONCE(counter, h.counter);
+	intn2_downtime_ns = ktime_get_ns() - h.frozen_ns;
+	WRITE_ONCE(intn2_state, INTN2_LIVE);
+	mutex_unlock(&intn2_handoff_lock);
+
+	pr_info("state restored %llu ns after the freeze\n", intn2_downtime_ns);
+	*l += size;
+	return size;
+}
+
+static const struct file_operations intn2_handoff_fops = {
+	.owner   = THIS_MODULE,
+	.read    = intn2_handoff_read,
+	.write   = intn2_handoff_write,
+	.llseek  = default_llseek,
+};
+
 /* define the driver file operations. These are function pointers used by
  * kernel when a call from user space is perfomed
  */
@@ -158,9 +746,17 @@ void intn2_cleanup(void)
 	if (intn2->intn2_device)
 		device_destroy(intn2->intn2_class, dev);
 
+	if (intn2->intn2_rate_device)
+		device_destroy(intn2->intn2_class,
+				MKDEV(intn2_major, intn2_minor + RATE_MINOR));
+
 	if (intn2->intn2_class)
 		class_destroy(intn2->intn2_class);
 
+	debugfs_remove_recursive(intn2->intn2_debugfs);
+	free_percpu(intn2->intn2_hist);
+	free_percpu(intn2->intn2_rates);
+	free_percpu(intn2->intn2_lstats);
 	kfree(intn2);
 	unregister_chrdev_region(dev, NR_DEVS);
 }
@@ -217,9 +813,59 @@ static int __init intn2_init(void)
 		goto fail;
 	}
 
+	intn2->intn2_rate_device = device_create(intn2->intn2_class, NULL,
+			MKDEV(intn2_major, intn2_minor + RATE_MINOR), NULL,
+			DEVNAME "_rate");
+	if (!intn2->intn2_rate_device) {
+		pr_err("Error creating device %s_rate\n", DEVNAME);
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	/* Mutex must be initialized  before the device is allocated */
 	mutex_init(&intn2->intn2_mutex);
 
+	intn2->intn2_lstats = alloc_percpu(struct intn2_lock_stats);
+	if (!intn2->intn2_lstats) {
+		pr_err("Error allocating the lock statistics\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	intn2->intn2_rates = alloc_percpu(struct intn2_rate);
+	if (!intn2->intn2_rates) {
+		pr_err("Error allocating the rate counters\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	if (hist) {
+		intn2->intn2_hist = alloc_percpu(struct intn2_hist);
+		if (!intn2->intn2_hist) {
+			pr_err("Error allocating the histograms\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	/* debugfs is optional, errors are ignored */
+	intn2->intn2_debugfs = debugfs_create_dir(DEVNAME, NULL);
+	debugfs_create_file("lock_stats", 0600, intn2->intn2_debugfs, NULL,
+			&intn2_lock_stats_fops);
+	debugfs_create_file("handoff", 0600, intn2->intn2_debugfs, NULL,
+			&intn2_handoff_fops);
+	debugfs_create_u64("downtime_ns", 0400, intn2->intn2_debugfs,
+			&intn2_downtime_ns);
+
+	if (hist)
+		debugfs_create_file("hist_reset", 0200, intn2->intn2_debugfs,
+				NULL, &intn2_hist_reset_fops);
+
+	if (restore) {
+		intn2_frozen_ns = ktime_get_ns();
+		intn2_state = INTN2_EMPTY;
+	}
+
 	/* char device registration */
 	devno = MKDEV(intn2_major, intn2_minor);
 	cdev_init(&intn2->intn2_cdev, &intn2_fops);
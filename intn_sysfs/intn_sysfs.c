@@ -15,6 +15,11 @@
  *
  * Implements sysfs attributes to communicate with userspace and the functions
  * already implemented by the intn2 driver
+ *
+ * A store wakes whoever waits in poll() for POLLPRI on the attribute, the
+ * way sysfs signals changes. A burst of stores is coalesced, there is at
+ * most one notification per notify_ms milliseconds, sent after the last
+ * store of the interval.
  */
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
@@ -27,6 +32,8 @@
 #include <linux/sysfs.h>
 #include <linux/device.h>
 #include <linux/ctype.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
 
 
 
@@ -40,6 +47,37 @@ struct mutex intn_sysfs_mutex;
 module_param(counter, int, 0664);
 MODULE_PARM_DESC(counter, " integer that holds the intn_sysfs driver counter");
 
+static unsigned int notify_ms = 100;
+module_param(notify_ms, uint, 0644);
+MODULE_PARM_DESC(notify_ms, " shortest interval between two notifications");
+
+/* jiffies of the last notification */
+static unsigned long intn_notified;
+
+static void intn_notify_fn(struct work_struct *work)
+{
+	WRITE_ONCE(intn_notified, jiffies);
+	sysfs_notify(&intn_sysfs_dev->dev.kobj, NULL, "intn");
+}
+
+static DECLARE_DELAYED_WORK(intn_notify_work, intn_notify_fn);
+
+/*
+ * Schedules the notification of a store, right away if the last one is
+ * older than notify_ms. Stores made while it is pending share it.
+ */
+static void intn_notify(void)
+{
+	unsigned long next = READ_ONCE(intn_notified) +
+		msecs_to_jiffies(READ_ONCE(notify_ms));
+	unsigned long delay = 0;
+
+	if (time_before(jiffies, next))
+		delay = next - jiffies;
+
+	schedule_delayed_work(&intn_notify_work, delay);
+}
+
 ssize_t intn_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	int ret;
@@ -64,6 +102,7 @@ ssize_t intn_store(struct device *dev, struct device_attribute *attr,
 
 	counter = tmp;
 	mutex_unlock(&dev->mutex);
+	intn_notify();
 	return ret ? : count;
 
 err:
@@ -93,6 +132,7 @@ static int intn_sysfs_init(void)
 	if (ret)
 		goto err;
 
+	intn_notified = jiffies;
 	sysfs_create_group(&intn_sysfs_dev->dev.kobj, &intn_attr_group);
 	mutex_init(&intn_sysfs_dev->dev.mutex);
 	return 0;
@@ -106,6 +146,8 @@ static void intn_sysfs_exit(void)
 {
 	pr_alert("unloading %s\n", DEVNAME);
 	sysfs_remove_group(&intn_sysfs_dev->dev.kobj, &intn_attr_group);
+	/* no store runs after the group is gone, none can queue it again */
+	cancel_delayed_work_sync(&intn_notify_work);
 	platform_device_unregister(intn_sysfs_dev);
 }
 
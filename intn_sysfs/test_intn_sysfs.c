@@ -17,6 +17,9 @@
  * user does not provide a value on the command line) threads, where each one
  * of them increments intn value by one concurrently. At the end the it is
  * expected to have a final value of X (initial) + N.
+ *
+ * With -w it instead waits in poll() for changes of the attribute and
+ * prints every value it is notified of, until it is interrupted.
  */
 
 #include <stdio.h>
@@ -29,6 +32,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <poll.h>
 
 #define NUM_THREADS 4
 #define INT_LEN    13
@@ -90,6 +94,45 @@ void *inc_devintn(void *data)
 	pthread_exit(NULL);
 }
 
+/* sysfs signals a change with POLLPRI | POLLERR, the file is read again */
+int watch(void)
+{
+	struct pollfd pfd;
+	char myint[INT_LEN];
+	ssize_t n;
+
+	pfd.fd = open(SYSFSFILE, O_RDONLY);
+	pfd.events = POLLPRI | POLLERR;
+
+	if (pfd.fd == -1) {
+		printf("error opening %s (%s)\n", SYSFSFILE, strerror(errno));
+		return -1;
+	}
+
+	for (;;) {
+		memset(myint, 0, INT_LEN);
+		n = pread(pfd.fd, myint, INT_LEN - 1, 0);
+
+		if (n < 0) {
+			printf("error reading from %s (%s)\n",
+					SYSFSFILE, strerror(errno));
+			break;
+		}
+
+		printf("value: %s", myint);
+		fflush(stdout);
+
+		if (poll(&pfd, 1, -1) < 0) {
+			printf("error polling %s (%s)\n",
+					SYSFSFILE, strerror(errno));
+			break;
+		}
+	}
+
+	close(pfd.fd);
+	return -1;
+}
+
 void help(void)
 {
 	fprintf(stderr,
@@ -98,6 +141,7 @@ void help(void)
 		"test_intn <thread_number>\n"
 		"  <thread_number>:  concurrent threads accessing /dev/intn\n"
 		"                    if not specified default to 4 threads.\n"
+		"  -w                print the value on every change\n"
 		"  -h                show this help message\n");
 }
 
@@ -110,6 +154,8 @@ int main(int argc, const char *argv[])
 		if (!strncmp(argv[1], opthelp, strlen(opthelp))) {
 			help();
 			return 0;
+		} else if (!strcmp(argv[1], "-w")) {
+			return watch();
 		} else if (atoi(argv[1]) > 0) {
 			nthreads = (uint32_t)atoi(argv[1]);
 			printf("Number of threads: %u\n", nthreads);
@@ -0,0 +1,409 @@
+/*
+ * Userspace throughput benchmark for the /dev/one driver
+ *
+ * Copyright (C) 2014 Rafael do Nascimento Pereira <rnp@25ghz.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This program measures how fast data can be pulled out of /dev/one. For
+ * every access method (read, readv, splice and mmap) and every request size
+ * it starts N threads, each pinned to its own CPU and with its own open
+ * file, which move the same amount of data. The results are printed as CSV
+ * on stdout, one line per method and size, with the aggregated throughput
+ * in GB/s and the number of syscalls per second.
+ *
+ * mmap maps one request size at a time and reads every 64 bit word of it,
+ * the other methods only copy the data into a buffer.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define NUM_THREADS 1
+#define DEVFILE     "/dev/one"
+#define TOTAL       (256UL << 20)
+#define NR_IOV      4
+
+const char *opthelp = "-h\0";
+
+enum method {
+	M_READ,
+	M_READV,
+	M_SPLICE,
+	M_MMAP,
+	NR_METHODS
+};
+
+static const char *method_names[NR_METHODS] = {
+	"read", "readv", "splice", "mmap"
+};
+
+static const size_t sizes[] = {
+	4096, 65536, 1 << 20, 16 << 20
+};
+
+struct tdata {
+	uint32_t tnum;
+	const char *dev;
+	int flags;
+	enum method m;
+	size_t size;
+	size_t total;
+	pthread_barrier_t *start;
+	uint64_t bytes;
+	uint64_t syscalls;
+	uint64_t sink;
+	int err;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pin(uint32_t tnum)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(tnum % (ncpus > 0 ? ncpus : 1), &set);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		fprintf(stderr, "thread[%u]: could not pin to a CPU\n", tnum);
+}
+
+static int run_read(struct tdata *t, int fd, char *buf)
+{
+	ssize_t n;
+
+	while (t->bytes < t->total) {
+		n = read(fd, buf, t->size);
+		t->syscalls++;
+
+		if (n <= 0)
+			return -1;
+		t->bytes += n;
+	}
+
+	return 0;
+}
+
+static int run_readv(struct tdata *t, int fd, char *buf)
+{
+	struct iovec iov[NR_IOV];
+	size_t seg = t->size / NR_IOV;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < NR_IOV; i++) {
+		iov[i].iov_base = buf + i * seg;
+		iov[i].iov_len = seg;
+	}
+
+	while (t->bytes < t->total) {
+		n = readv(fd, iov, NR_IOV);
+		t->syscalls++;
+
+		if (n <= 0)
+			return -1;
+		t->bytes += n;
+	}
+
+	return 0;
+}
+
+/* moves the data through a pipe into /dev/null, never touching userspace */
+static int run_splice(struct tdata *t, int fd)
+{
+	int p[2], null;
+	ssize_t n, m;
+	int ret = -1;
+
+	if (pipe(p))
+		return -1;
+
+	/* the pipe may be capped by /proc/sys/fs/pipe-max-size */
+	fcntl(p[1], F_SETPIPE_SZ, t->size);
+	null = open("/dev/null", O_WRONLY);
+
+	if (null < 0)
+		goto out;
+
+	while (t->bytes < t->total) {
+		n = splice(fd, NULL, p[1], NULL, t->size, SPLICE_F_MOVE);
+		t->syscalls++;
+
+		if (n <= 0)
+			goto out;
+
+		while (n > 0) {
+			m = splice(p[0], NULL, null, NULL, n, SPLICE_F_MOVE);
+			t->syscalls++;
+
+			if (m <= 0)
+				goto out;
+			n -= m;
+			t->bytes += m;
+		}
+	}
+
+	ret = 0;
+out:
+	if (null >= 0)
+		close(null);
+	close(p[0]);
+	close(p[1]);
+	return ret;
+}
+
+static int run_mmap(struct tdata *t, int fd)
+{
+	const uint64_t *p;
+	uint64_t sum = 0;
+	size_t i;
+
+	while (t->bytes < t->total) {
+		p = mmap(NULL, t->size, PROT_READ, MAP_SHARED, fd, 0);
+		t->syscalls++;
+
+		if (p == MAP_FAILED)
+			return -1;
+
+		for (i = 0; i < t->size / sizeof(*p); i++)
+			sum += p[i];
+
+		munmap((void *)p, t->size);
+		t->syscalls++;
+		t->bytes += t->size;
+	}
+
+	t->sink = sum;
+	return 0;
+}
+
+void *bench_thread(void *data)
+{
+	struct tdata *t = data;
+	char *buf = NULL;
+	int fd;
+
+	pin(t->tnum);
+	fd = open(t->dev, O_RDONLY | t->flags);
+
+	if (fd == -1) {
+		fprintf(stderr, "thread[%u]: error opening %s (%s)\n",
+				t->tnum, t->dev, strerror(errno));
+		t->err = errno;
+	} else if (t->m == M_READ || t->m == M_READV) {
+		buf = malloc(t->size);
+
+		if (!buf)
+			t->err = ENOMEM;
+		else
+			memset(buf, 0, t->size);
+	}
+
+	pthread_barrier_wait(t->start);
+
+	if (t->err)
+		return NULL;
+
+	switch (t->m) {
+	case M_READ:
+		t->err = run_read(t, fd, buf);
+		break;
+	case M_READV:
+		t->err = run_readv(t, fd, buf);
+		break;
+	case M_SPLICE:
+		t->err = run_splice(t, fd);
+		break;
+	case M_MMAP:
+		t->err = run_mmap(t, fd);
+		break;
+	default:
+		break;
+	}
+
+	if (t->err)
+		fprintf(stderr, "thread[%u]: %s failed (%s)\n",
+				t->tnum, method_names[t->m], strerror(errno));
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/* runs one method and size on all threads and prints the CSV line */
+static int bench(const char *dev, int flags, uint32_t nthreads,
+		enum method m, size_t size, size_t total)
+{
+	pthread_t threads[nthreads];
+	struct tdata data[nthreads];
+	pthread_barrier_t start;
+	uint64_t bytes = 0, syscalls = 0;
+	double t0, t1;
+	uint32_t i;
+	int err = 0;
+
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+
+	for (i = 0; i < nthreads; i++) {
+		memset(&data[i], 0, sizeof(data[i]));
+		data[i].tnum = i;
+		data[i].dev = dev;
+		data[i].flags = flags;
+		data[i].m = m;
+		data[i].size = size;
+		data[i].total = total < size ? size : total;
+		data[i].start = &start;
+
+		if (pthread_create(&threads[i], NULL, bench_thread, &data[i])) {
+			fprintf(stderr, "ERROR: could not create thread %u\n", i);
+			exit(-1);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	t0 = now();
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	t1 = now();
+	pthread_barrier_destroy(&start);
+
+	for (i = 0; i < nthreads; i++) {
+		bytes += data[i].bytes;
+		syscalls += data[i].syscalls;
+		err |= data[i].err;
+	}
+
+	if (err)
+		return -1;
+
+	printf("%s,%u,%zu,%llu,%.6f,%.3f,%.0f\n", method_names[m], nthreads,
+			size, (unsigned long long)bytes, t1 - t0,
+			bytes / (t1 - t0) / 1e9, syscalls / (t1 - t0));
+	fflush(stdout);
+	return 0;
+}
+
+void help(void)
+{
+	fprintf(stderr,
+		"llkdd  Copyright (C) 2014 Rafael do Nascimento Pereira\n"
+		"one device driver userspace benchmark programm\n\n"
+		"bench_one [-t <threads>] [-s <size>] [-m <method>] [-b <bytes>]\n"
+		"          [-d <device>] [-n]\n"
+		"  -t <threads>  concurrent pinned threads, defaults to 1\n"
+		"  -s <size>     request size in bytes, defaults to a sweep\n"
+		"                of 4K, 64K, 1M and 16M\n"
+		"  -m <method>   read, readv, splice or mmap, defaults to all\n"
+		"  -b <bytes>    bytes moved by every thread, defaults to 256M\n"
+		"  -d <device>   device to read, defaults to /dev/one\n"
+		"  -n            open with O_DIRECT, large reads bypass the cache\n"
+		"  -h            show this help message\n");
+}
+
+int main(int argc, char *const argv[])
+{
+	const char *dev = DEVFILE;
+	int flags = 0;
+	uint32_t nthreads = NUM_THREADS;
+	size_t total = TOTAL;
+	size_t size = 0;
+	int method = -1;
+	int opt, m;
+	size_t i;
+
+	if (argc > 1 && !strncmp(argv[1], opthelp, strlen(opthelp))) {
+		help();
+		return 0;
+	}
+
+	while ((opt = getopt(argc, argv, "t:s:m:b:d:n")) != -1) {
+		switch (opt) {
+		case 't':
+			if (atoi(optarg) <= 0) {
+				printf("invalid number of threads. exiting..\n");
+				return -1;
+			}
+			nthreads = (uint32_t)atoi(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		case 'n':
+			flags |= O_DIRECT;
+			break;
+		case 'm':
+			for (m = 0; m < NR_METHODS; m++)
+				if (!strcmp(optarg, method_names[m]))
+					method = m;
+
+			if (method < 0) {
+				printf("invalid method %s. exiting..\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			help();
+			return -1;
+		}
+	}
+
+	if (size && size % NR_IOV) {
+		printf("size must be a multiple of %d. exiting..\n", NR_IOV);
+		return -1;
+	}
+
+	printf("method,threads,size,bytes,seconds,GB/s,syscalls/s\n");
+
+	for (m = 0; m < NR_METHODS; m++) {
+		if (method >= 0 && m != method)
+			continue;
+
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			if (size && i > 0)
+				break;
+
+			if (bench(dev, flags, nthreads, m,
+						size ? size : sizes[i], total))
+				return -1;
+		}
+	}
+
+	return 0;
+}
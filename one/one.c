@@ -14,8 +14,20 @@
  * GNU General Public License for more details.
  *
  * Dummy character device driver that performs the same functionality
- * found on /dev/zero, except the read output is ones. This is not a
- * practical driver, it is just written for learning purposes.
+ * found on /dev/zero, except the read output is ones. The output can be
+ * changed to any repeating pattern of up to 64 bytes, module wide with the
+ * pattern parameter or per open file with ONE_IOC_SET_PATTERN. A file can
+ * also stream seeded pseudo-random data with ONE_IOC_SET_SEED. This is not
+ * a practical driver, it is just written for learning purposes.
+ *
+ * With nr_devs > 1 the driver creates several minors, one0..oneN, each
+ * with its own pattern, set through its pattern attribute in sysfs.
+ *
+ * Large reads can bypass the CPU caches, see ONE_F_NOCACHE.
+ *
+ * Writes are accepted like on /dev/null, and checked against the stream a
+ * read at the same offset returns. The stats attribute of every minor
+ * shows the throughput of each mode and the verification results.
  *
  */
 
@@ -29,6 +41,26 @@
 #include <linux/slab.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/percpu.h>
+#include <linux/gfp.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/mm.h>
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/kref.h>
+#include <linux/srcu.h>
+#include <linux/overflow.h>
+#include <linux/math64.h>
+#include <linux/highmem.h>
+#include <linux/sched/clock.h>
+#include <linux/string.h>
+#include <linux/atomic.h>
+#include <asm/unaligned.h>
+
+#include "one.h"
 
 
 /* Driver infos */
@@ -40,44 +72,913 @@ MODULE_VERSION("0.1");
 #define DEVNAME "one"
 #define CLASSNAME "dummy"
 #define NR_DEVS 1
+#define MAX_DEVS 64
 
 
 static int one_major;
 static int one_minor;
 
-char c = 0;
+static int nr_devs = NR_DEVS;
+module_param(nr_devs, int, 0444);
+MODULE_PARM_DESC(nr_devs, "number of minors, named one0..oneN if more than 1");
+
+static char *pattern = "01";
+module_param(pattern, charp, 0444);
+MODULE_PARM_DESC(pattern, "default fill pattern, in hex (up to 64 bytes)");
+
+static unsigned long nocache_threshold = 1 << 20;
+module_param(nocache_threshold, ulong, 0644);
+MODULE_PARM_DESC(nocache_threshold,
+		"smallest read bypassing the cache with ONE_F_NOCACHE or O_DIRECT");
+
+/* user pages pinned at once by the cache bypassing fill */
+#define NOCACHE_PAGES 16
+
+/* the read modes, accounted separately in the stats attribute */
+enum one_mode {
+	ONE_MODE_PATTERN,
+	ONE_MODE_NOCACHE,
+	ONE_MODE_PRNG,
+	ONE_MODE_VERIFY,
+	ONE_NR_MODES
+};
+
+static const char * const one_mode_names[ONE_NR_MODES] = {
+	"pattern", "nocache", "prng", "verify"
+};
+
+struct one_stats {
+	u64 calls[ONE_NR_MODES];
+	u64 bytes[ONE_NR_MODES];
+	u64 ns[ONE_NR_MODES];
+	u64 mismatched;
+};
+
+/*
+ * A fill holds pages with a pattern repeated from offset 0. Shared fills
+ * have one page per memory node and, if the pattern tiles a page, a PMD
+ * sized compound page for mmap(). The default one is shared by all the
+ * minors until a minor's pattern is set. Fills set through
+ * ONE_IOC_SET_PATTERN only belong to one file and have a single page. The
+ * pages are never written after allocation, so readers do not share any
+ * writable cache line.
+ */
+struct one_fill {
+	struct kref ref;
+	struct one_pattern pat;
+	struct page *huge;
+	unsigned int nr_bufs;
+	void *buf[];
+};
+
+/*
+ * In pseudo-random mode the stream is generated into scratch, and written
+ * data is copied into inbuf to be verified, allocated when the file is
+ * opened for writing. Both pages are protected by lock in case several
+ * threads use the same file.
+ */
+struct one_file {
+	struct one_dev *dev;
+	struct one_fill __rcu *fill;
+	u32 flags;
+	bool prng;
+	u64 seed;
+	struct mutex lock;
+	__le64 *scratch;
+	u8 *inbuf;
+};
 
+/*
+ * One per minor, each on its own cache lines, allocated from a cache with
+ * SLAB_HWCACHE_ALIGN so the alignment holds. Files take a reference on
+ * the device fill when they are opened, so the read path only reads the
+ * stats pointer and updates this CPU's counters.
+ */
 struct one_dev {
 	struct cdev one_cdev;
 	struct device *one_device;
-	struct class *one_class;
-};
+	struct one_fill __rcu *fill;
+	struct one_stats __percpu *stats;
+	atomic64_t first_mismatch;
+} ____cacheline_aligned_in_smp;
+
+static struct class *one_class;
+static struct kmem_cache *one_dev_cache;
+static struct one_dev *one[MAX_DEVS];
+
+/*
+ * Readers hold one_srcu while copying from a file's fill, so replacing the
+ * fill of a file only has to wait for them before dropping the old one.
+ */
+DEFINE_STATIC_SRCU(one_srcu);
+
+
+/*
+ * Repeats the pattern over len bytes. The copied block doubles on every
+ * step and always ends on a pattern boundary, so only a few memcpy() calls
+ * are needed to fill a whole page.
+ */
+static void one_pattern_fill(void *dst, size_t len,
+		const struct one_pattern *pat)
+{
+	size_t n = min_t(size_t, len, pat->len);
+
+	memcpy(dst, pat->bytes, n);
+
+	while (n < len) {
+		size_t step = min(n, len - n);
+
+		memcpy(dst + n, dst, step);
+		n += step;
+	}
+}
+
+static void one_fill_release(struct kref *ref)
+{
+	struct one_fill *fill = container_of(ref, struct one_fill, ref);
+	unsigned int i;
+
+	for (i = 0; i < fill->nr_bufs; i++)
+		if (fill->buf[i])
+			free_page((unsigned long)fill->buf[i]);
+
+	if (fill->huge)
+		__free_pages(fill->huge, compound_order(fill->huge));
+
+	kfree(fill);
+}
+
+static void one_fill_put(struct one_fill *fill)
+{
+	kref_put(&fill->ref, one_fill_release);
+}
+
+/*
+ * Allocates a fill for the given pattern. A shared fill gets a page per
+ * possible memory node and, if memory allows, the huge page. Failing to
+ * get that one is not an error, the mappings just stay PTE mapped.
+ */
+static struct one_fill *one_fill_alloc(const struct one_pattern *pat,
+		bool shared)
+{
+	unsigned int nr = shared ? nr_node_ids : 1;
+	struct one_fill *fill;
+	struct page *page;
+	unsigned int i;
+
+	fill = kzalloc(struct_size(fill, buf, nr), GFP_KERNEL);
+
+	if (!fill)
+		return NULL;
+
+	kref_init(&fill->ref);
+	fill->pat = *pat;
+	fill->nr_bufs = nr;
+
+	for (i = 0; i < nr; i++) {
+		if (shared && !node_possible(i))
+			continue;
+
+		page = alloc_pages_node(shared ? i : NUMA_NO_NODE,
+				GFP_KERNEL, 0);
+
+		if (!page)
+			goto fail;
+
+		fill->buf[i] = page_address(page);
+		one_pattern_fill(fill->buf[i], PAGE_SIZE, pat);
+	}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	if (shared && PAGE_SIZE % pat->len == 0) {
+		fill->huge = alloc_pages(GFP_KERNEL | __GFP_COMP |
+				__GFP_NORETRY | __GFP_NOWARN, HPAGE_PMD_ORDER);
+
+		if (fill->huge)
+			one_pattern_fill(page_address(fill->huge),
+					HPAGE_PMD_SIZE, pat);
+		else
+			pr_info("no huge page, mmap uses small pages\n");
+	}
+#endif
+
+	return fill;
+fail:
+	one_fill_put(fill);
+	return NULL;
+}
+
+static inline const void *one_fill_buf(const struct one_fill *fill)
+{
+	/* a private fill, or a shared one with a single node */
+	if (fill->nr_bufs == 1)
+		return fill->buf[0];
+
+	/*
+	 * All the pages hold the same bytes, so it does not matter if we get
+	 * migrated while copying from this one.
+	 */
+	return fill->buf[numa_node_id()];
+}
+
+/*
+ * Returns how many bytes of the stream at offset pos can be copied in one
+ * go, and where from. The copy starts inside the first pattern period of
+ * the page, at the same phase as pos.
+ */
+static size_t one_fill_chunk(const struct one_fill *fill, loff_t pos,
+		size_t left, const void **src)
+{
+	u32 phase;
+
+	div_u64_rem((u64)pos, fill->pat.len, &phase);
+	*src = one_fill_buf(fill) + phase;
+
+	return min_t(size_t, left, PAGE_SIZE - phase);
+}
+
+/* four independent words per step keep the multipliers busy */
+static void one_prng_fill(__le64 *dst, u64 seed, u64 index, size_t nwords)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= nwords; i += 4) {
+		dst[i]     = cpu_to_le64(one_prng_word(seed, index + i));
+		dst[i + 1] = cpu_to_le64(one_prng_word(seed, index + i + 1));
+		dst[i + 2] = cpu_to_le64(one_prng_word(seed, index + i + 2));
+		dst[i + 3] = cpu_to_le64(one_prng_word(seed, index + i + 3));
+	}
+
+	for (; i < nwords; i++)
+		dst[i] = cpu_to_le64(one_prng_word(seed, index + i));
+}
+
+/*
+ * Same as one_fill_chunk() for the pseudo-random stream. The words
+ * covering the chunk are generated into the scratch page first, the
+ * caller holds of->lock.
+ */
+static size_t one_prng_chunk(struct one_file *of, loff_t pos, size_t left,
+		const void **src)
+{
+	size_t off = pos & 7;
+	size_t n = min_t(size_t, left, PAGE_SIZE - off);
+
+	one_prng_fill(of->scratch, of->seed, (u64)pos >> 3,
+			DIV_ROUND_UP(off + n, 8));
+	*src = (void *)of->scratch + off;
+
+	return n;
+}
+
+static size_t one_chunk(struct one_file *of, const struct one_fill *fill,
+		bool prng, loff_t pos, size_t left, const void **src)
+{
+	if (prng)
+		return one_prng_chunk(of, pos, left, src);
+
+	return one_fill_chunk(fill, pos, left, src);
+}
+
+static inline bool one_want_nocache(struct one_file *of, bool direct,
+		size_t size)
+{
+	if (!direct && !(READ_ONCE(of->flags) & ONE_F_NOCACHE))
+		return false;
+
+	return size >= READ_ONCE(nocache_threshold);
+}
+
+/*
+ * Fills the user buffer behind the iterator with non-temporal stores, so
+ * the data does not go through the caches. The user pages are pinned and
+ * written through their kernel mapping with memcpy_flushcache(), which
+ * uses movnti on x86 and is a plain memcpy() where there is nothing
+ * better. Returns the bytes written, or an error if there are none.
+ */
+static ssize_t one_fill_nocache(struct one_file *of,
+		const struct one_fill *fill, bool prng, loff_t pos,
+		struct iov_iter *to)
+{
+	struct page *pages[NOCACHE_PAGES];
+	ssize_t ret = 0;
+	size_t done = 0;
+
+	while (iov_iter_count(to)) {
+		size_t start, off, n, chunk;
+		const void *src;
+		ssize_t got;
+		void *dst;
+		int i;
+
+		got = iov_iter_get_pages2(to, pages, iov_iter_count(to),
+				NOCACHE_PAGES, &start);
+
+		if (got <= 0) {
+			ret = got ? got : -EFAULT;
+			break;
+		}
+
+		for (i = 0, off = start; got > 0; i++, off = 0) {
+			n = min_t(size_t, got, PAGE_SIZE - off);
+			dst = kmap_local_page(pages[i]);
+			got -= n;
+			done += n;
+
+			while (n) {
+				chunk = one_chunk(of, fill, prng, pos, n, &src);
+				memcpy_flushcache(dst + off, src, chunk);
+				off += chunk;
+				pos += chunk;
+				n -= chunk;
+			}
+
+			kunmap_local(dst);
+			set_page_dirty_lock(pages[i]);
+			put_page(pages[i]);
+		}
+
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	/* order the non-temporal stores before returning to userspace */
+	wmb();
+
+	return done ? done : ret;
+}
+
+/*
+ * Copies the stream into any kind of iterator. Returns the bytes copied,
+ * or an error if there are none.
+ */
+static ssize_t one_fill_iter(struct one_file *of, const struct one_fill *fill,
+		bool prng, loff_t pos, struct iov_iter *to)
+{
+	ssize_t ret = 0;
+	size_t done = 0;
+
+	while (iov_iter_count(to)) {
+		const void *src;
+		size_t chunk;
+		size_t n;
 
-struct one_dev *one = NULL;
+		chunk = one_chunk(of, fill, prng, pos + done,
+				iov_iter_count(to), &src);
+		n = copy_to_iter(src, chunk, to);
+		done += n;
 
+		/* a fault, or a pipe with no more free buffers */
+		if (n < chunk) {
+			ret = -EFAULT;
+			break;
+		}
 
-/* The read() file opetation, it returns only a "1" character to user space */
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	return done ? done : ret;
+}
+
+static void one_account(struct one_file *of, enum one_mode mode,
+		size_t bytes, u64 start)
+{
+	struct one_stats __percpu *stats = of->dev->stats;
+
+	this_cpu_inc(stats->calls[mode]);
+	this_cpu_add(stats->bytes[mode], bytes);
+	this_cpu_add(stats->ns[mode], local_clock() - start);
+}
+
+/*
+ * The read() file operation. It fills the whole user buffer with the
+ * file's pattern, copying at most a page at a time. The file position
+ * keeps track of the pattern phase between reads.
+ */
 ssize_t one_read(struct file *f, char __user *u, size_t size, loff_t *l)
 {
-	c = 1;
+	struct one_file *of = f->private_data;
+	bool prng = READ_ONCE(of->prng);
+	u64 start = local_clock();
+	struct one_fill *fill;
+	struct kiocb kiocb;
+	struct iov_iter iter;
+	struct iovec iov;
+	ssize_t ret = 0;
+	size_t done = 0;
+	int idx;
+
+	/* the cache bypassing fill works on iterators */
+	if (one_want_nocache(of, f->f_flags & O_DIRECT, size)) {
+		ret = import_single_range(READ, u, size, &iov, &iter);
+
+		if (ret)
+			return ret;
+
+		init_sync_kiocb(&kiocb, f);
+		kiocb.ki_pos = *l;
+		ret = f->f_op->read_iter(&kiocb, &iter);
+		*l = kiocb.ki_pos;
+		return ret;
+	}
+
+	if (prng)
+		mutex_lock(&of->lock);
+
+	idx = srcu_read_lock(&one_srcu);
+	fill = srcu_dereference(of->fill, &one_srcu);
+
+	while (done < size) {
+		const void *src;
+		size_t chunk;
+		unsigned long left;
+
+		chunk = one_chunk(of, fill, prng, *l + done, size - done, &src);
+		left = copy_to_user(u + done, src, chunk);
+		done += chunk - left;
+
+		if (left) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	srcu_read_unlock(&one_srcu, idx);
+
+	if (prng)
+		mutex_unlock(&of->lock);
+
+	if (!done)
+		return ret;
+
+	one_account(of, prng ? ONE_MODE_PRNG : ONE_MODE_PATTERN, done, start);
+	*l += done;
+	return done;
+}
+
+
+/*
+ * The read_iter() file operation, used by readv(), io_uring and, through
+ * generic_file_splice_read(), by splice() and sendfile(). It does the same
+ * as one_read() on any kind of iov_iter, and does the cache bypassing
+ * fill for user buffers.
+ */
+static ssize_t one_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct one_file *of = iocb->ki_filp->private_data;
+	bool prng = READ_ONCE(of->prng);
+	u64 start = local_clock();
+	enum one_mode mode;
+	bool nocache;
+	struct one_fill *fill;
+	ssize_t ret;
+	int idx;
 
-	/* copy the buffer to user space */
-	if (copy_to_user(u, &c, 1) != 0) {
-		pr_err("error copying buffer to user space\n");
-		return -EFAULT;
-	} else
-		return 1;
+	nocache = user_backed_iter(to) &&
+		one_want_nocache(of, iocb->ki_flags & IOCB_DIRECT,
+				iov_iter_count(to));
+
+	/* pinning the user pages may sleep, let io_uring retry from a worker */
+	if (nocache && (iocb->ki_flags & IOCB_NOWAIT))
+		return -EAGAIN;
+
+	if (prng) {
+		if (iocb->ki_flags & IOCB_NOWAIT) {
+			if (!mutex_trylock(&of->lock))
+				return -EAGAIN;
+		} else {
+			mutex_lock(&of->lock);
+		}
+	}
+
+	mode = nocache ? ONE_MODE_NOCACHE : prng ? ONE_MODE_PRNG :
+		ONE_MODE_PATTERN;
+
+	idx = srcu_read_lock(&one_srcu);
+	fill = srcu_dereference(of->fill, &one_srcu);
+
+	if (nocache)
+		ret = one_fill_nocache(of, fill, prng, iocb->ki_pos, to);
+	else
+		ret = one_fill_iter(of, fill, prng, iocb->ki_pos, to);
+
+	srcu_read_unlock(&one_srcu, idx);
+
+	if (prng)
+		mutex_unlock(&of->lock);
+
+	if (ret <= 0)
+		return ret;
+
+	one_account(of, mode, ret, start);
+	iocb->ki_pos += ret;
+	return ret;
 }
 
+static inline unsigned long one_xor_word(const u8 *a, const u8 *b)
+{
+	return get_unaligned((const unsigned long *)a) ^
+		get_unaligned((const unsigned long *)b);
+}
+
+/*
+ * Compares len bytes, four words per step while they match. Returns how
+ * many bytes differ and sets *first to the offset of the first of them,
+ * or to len if there is none.
+ */
+static size_t one_verify(const u8 *a, const u8 *b, size_t len, size_t *first)
+{
+	const size_t w = sizeof(unsigned long);
+	size_t i = 0, bad = 0;
+
+	for (; i + 4 * w <= len; i += 4 * w) {
+		if (one_xor_word(a + i, b + i) |
+				one_xor_word(a + i + w, b + i + w) |
+				one_xor_word(a + i + 2 * w, b + i + 2 * w) |
+				one_xor_word(a + i + 3 * w, b + i + 3 * w))
+			break;
+	}
+
+	*first = len;
+
+	for (; i < len; i++) {
+		if (a[i] != b[i] && !bad++)
+			*first = i;
+	}
+
+	return bad;
+}
+
+/*
+ * The write_iter() file operation, also used by write(2) and, through
+ * iter_file_splice_write(), by splice() and sendfile(). Like /dev/null it
+ * takes everything, but it also checks the data against the stream a read
+ * at the same offset would return, and accounts the result in the device
+ * stats.
+ */
+static ssize_t one_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct one_file *of = iocb->ki_filp->private_data;
+	struct one_dev *dev = of->dev;
+	u64 start = local_clock();
+	loff_t pos = iocb->ki_pos;
+	struct one_fill *fill;
+	size_t bad = 0;
+	s64 first = -1;
+	ssize_t ret = 0;
+	size_t done = 0;
+	int idx;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&of->lock))
+			return -EAGAIN;
+	} else {
+		mutex_lock(&of->lock);
+	}
+
+	idx = srcu_read_lock(&one_srcu);
+	fill = srcu_dereference(of->fill, &one_srcu);
+
+	while (iov_iter_count(from)) {
+		size_t chunk = min_t(size_t, iov_iter_count(from), PAGE_SIZE);
+		size_t n, off, len, at;
+		const void *expect;
+
+		n = copy_from_iter(of->inbuf, chunk, from);
+
+		for (off = 0; off < n; off += len) {
+			len = one_chunk(of, fill, of->prng, pos + off, n - off,
+					&expect);
+			bad += one_verify(of->inbuf + off, expect, len, &at);
+
+			if (at < len && first < 0)
+				first = pos + off + at;
+		}
+
+		pos += n;
+		done += n;
+
+		if (n < chunk) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	srcu_read_unlock(&one_srcu, idx);
+	mutex_unlock(&of->lock);
+
+	if (first >= 0)
+		atomic64_cmpxchg(&dev->first_mismatch, -1, first);
+
+	if (!done)
+		return ret;
+
+	this_cpu_add(dev->stats->mismatched, bad);
+	one_account(of, ONE_MODE_VERIFY, done, start);
+	iocb->ki_pos = pos;
+	return done;
+}
+
+static long one_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct one_file *of = filp->private_data;
+	void __user *argp = (void __user *)arg;
+	struct one_pattern pat;
+	struct one_fill *fill, *old;
+	u64 seed;
+	u32 flags;
+	int idx;
+
+	switch (cmd) {
+	case ONE_IOC_SET_PATTERN:
+		if (copy_from_user(&pat, argp, sizeof(pat)))
+			return -EFAULT;
+
+		if (pat.len == 0 || pat.len > ONE_PATTERN_MAX)
+			return -EINVAL;
+
+		fill = one_fill_alloc(&pat, false);
+
+		if (!fill)
+			return -ENOMEM;
+
+		old = unrcu_pointer(xchg(&of->fill, RCU_INITIALIZER(fill)));
+		WRITE_ONCE(of->prng, false);
+		synchronize_srcu(&one_srcu);
+		one_fill_put(old);
+		return 0;
+
+	case ONE_IOC_SET_SEED:
+		if (copy_from_user(&seed, argp, sizeof(seed)))
+			return -EFAULT;
+
+		mutex_lock(&of->lock);
+
+		if (!of->scratch) {
+			of->scratch = (__le64 *)__get_free_page(GFP_KERNEL);
+
+			if (!of->scratch) {
+				mutex_unlock(&of->lock);
+				return -ENOMEM;
+			}
+		}
+
+		of->seed = seed;
+		WRITE_ONCE(of->prng, true);
+		mutex_unlock(&of->lock);
+		return 0;
+
+	case ONE_IOC_SET_FLAGS:
+		if (get_user(flags, (u32 __user *)argp))
+			return -EFAULT;
+
+		if (flags & ~ONE_F_ALL)
+			return -EINVAL;
+
+		WRITE_ONCE(of->flags, flags);
+		return 0;
+
+	case ONE_IOC_GET_FLAGS:
+		return put_user(READ_ONCE(of->flags), (u32 __user *)argp);
+
+	case ONE_IOC_GET_PATTERN:
+		idx = srcu_read_lock(&one_srcu);
+		pat = srcu_dereference(of->fill, &one_srcu)->pat;
+		srcu_read_unlock(&one_srcu, idx);
+
+		if (copy_to_user(argp, &pat, sizeof(pat)))
+			return -EFAULT;
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+/* the page of the faulting CPU's node, node 0 may not even exist */
+static inline struct page *one_vma_page(struct vm_area_struct *vma)
+{
+	struct one_fill *fill = vma->vm_private_data;
+
+	return virt_to_page(one_fill_buf(fill));
+}
+
+/*
+ * Private mappings get the fill page on the read fault, the core mm then
+ * copies it into an anonymous page on the first write.
+ */
+static vm_fault_t one_private_fault(struct vm_fault *vmf)
+{
+	struct page *page = one_vma_page(vmf->vma);
+
+	get_page(page);
+	vmf->page = page;
+	return 0;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Maps the whole PMD around the fault to the huge page, if the mapping
+ * covers it and it is not mapped by PTEs already. The kernels this builds
+ * on never call ->huge_fault for VM_PFNMAP mappings, but the PMD is still
+ * empty when ->fault runs, so it is done from there. Losing the race
+ * against another fault just retries the access.
+ */
+static vm_fault_t one_shared_huge_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct one_fill *fill = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	pfn_t pfn;
+
+	if (!fill->huge || (vma->vm_flags & VM_NOHUGEPAGE))
+		return VM_FAULT_FALLBACK;
+
+	if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	if (!pmd_none(*vmf->pmd))
+		return VM_FAULT_FALLBACK;
+
+	pfn = __pfn_to_pfn_t(page_to_pfn(fill->huge), PFN_DEV);
+	return vmf_insert_pfn_pmd(vmf, pfn, false);
+}
+#else
+static inline vm_fault_t one_shared_huge_fault(struct vm_fault *vmf)
+{
+	return VM_FAULT_FALLBACK;
+}
+#endif
+
+/*
+ * Shared mappings are read only, so the pages are inserted as raw PFNs,
+ * without rmap or page references. The fill outlives the mapping.
+ */
+static vm_fault_t one_shared_fault(struct vm_fault *vmf)
+{
+	vm_fault_t ret = one_shared_huge_fault(vmf);
+
+	if (ret != VM_FAULT_FALLBACK)
+		return ret;
+
+	return vmf_insert_pfn(vmf->vma, vmf->address,
+			page_to_pfn(one_vma_page(vmf->vma)));
+}
+
+/* every mapping, including split and forked copies, holds a fill reference */
+static void one_vm_open(struct vm_area_struct *vma)
+{
+	struct one_fill *fill = vma->vm_private_data;
+
+	kref_get(&fill->ref);
+}
+
+static void one_vm_close(struct vm_area_struct *vma)
+{
+	one_fill_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct one_private_vm_ops = {
+	.open  = one_vm_open,
+	.close = one_vm_close,
+	.fault = one_private_fault,
+};
+
+static const struct vm_operations_struct one_shared_vm_ops = {
+	.open       = one_vm_open,
+	.close      = one_vm_close,
+	.fault      = one_shared_fault,
+};
+
+/*
+ * The mmap() file operation. Shared mappings can never become writable,
+ * otherwise a process could change the pattern seen by everybody else.
+ * Mappings are built from whole fill pages, so the pattern length has to
+ * divide the page size. Shared mappings use the huge page for every whole
+ * PMD they cover, private ones are copied on write one page at a time.
+ */
+static int one_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct one_file *of = filp->private_data;
+	struct one_fill *fill;
+	int idx;
+
+	if ((vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_WRITE))
+		return -EACCES;
+
+	/* the pseudo-random stream has no pages to map */
+	if (READ_ONCE(of->prng))
+		return -EINVAL;
+
+	idx = srcu_read_lock(&one_srcu);
+	fill = srcu_dereference(of->fill, &one_srcu);
+
+	if (PAGE_SIZE % fill->pat.len) {
+		srcu_read_unlock(&one_srcu, idx);
+		return -EINVAL;
+	}
+
+	kref_get(&fill->ref);
+	srcu_read_unlock(&one_srcu, idx);
+
+	vma->vm_private_data = fill;
+
+	if (vma->vm_flags & VM_SHARED) {
+		vma->vm_flags &= ~VM_MAYWRITE;
+		vma->vm_flags |= VM_PFNMAP;
+		vma->vm_ops = &one_shared_vm_ops;
+	} else {
+		vma->vm_ops = &one_private_vm_ops;
+	}
+
+	return 0;
+}
+
+/* places mappings at a PMD aligned offset on a PMD boundary */
+static unsigned long one_get_unmapped_area(struct file *filp,
+		unsigned long addr, unsigned long len, unsigned long pgoff,
+		unsigned long flags)
+{
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	return thp_get_unmapped_area(filp, addr, len, pgoff, flags);
+#else
+	return current->mm->get_unmapped_area(filp, addr, len, pgoff, flags);
+#endif
+}
 
 int one_release(struct inode *inode, struct file *filp)
 {
+	struct one_file *of = filp->private_data;
+
+	one_fill_put(rcu_dereference_protected(of->fill, 1));
+	free_page((unsigned long)of->scratch);
+	free_page((unsigned long)of->inbuf);
+	kfree(of);
 	return 0;
 }
 
 
 int one_open(struct inode *inode, struct file *filp)
 {
+	struct one_dev *dev = container_of(inode->i_cdev, struct one_dev,
+			one_cdev);
+	struct one_fill *fill;
+	struct one_file *of;
+	int idx;
+
+	of = kzalloc(sizeof(*of), GFP_KERNEL);
+
+	if (!of)
+		return -ENOMEM;
+
+	mutex_init(&of->lock);
+
+	/* allocated here, so IOCB_NOWAIT writes never have to */
+	if (filp->f_mode & FMODE_WRITE) {
+		of->inbuf = (u8 *)__get_free_page(GFP_KERNEL);
+
+		if (!of->inbuf) {
+			kfree(of);
+			return -ENOMEM;
+		}
+	}
+
+	idx = srcu_read_lock(&one_srcu);
+	fill = srcu_dereference(dev->fill, &one_srcu);
+	kref_get(&fill->ref);
+	srcu_read_unlock(&one_srcu, idx);
+
+	RCU_INIT_POINTER(of->fill, fill);
+	of->dev = dev;
+	filp->private_data = of;
+
+	/* O_DIRECT is the open flag way of asking for ONE_F_NOCACHE */
+	filp->f_mode |= FMODE_CAN_ODIRECT;
+
+	/* reads and writes never block, io_uring can issue them inline */
+	filp->f_mode |= FMODE_NOWAIT;
 	return 0;
 }
 
@@ -86,31 +987,239 @@ int one_open(struct inode *inode, struct file *filp)
  */
 static const struct file_operations one_fops = {
 	.owner   = THIS_MODULE,
+	.llseek  = no_seek_end_llseek,
 	.read    = one_read,
+	.read_iter   = one_read_iter,
+	.write_iter  = one_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.unlocked_ioctl = one_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.mmap    = one_mmap,
+	.get_unmapped_area = one_get_unmapped_area,
 	.open    = one_open,
 	.release = one_release,
 };
 
+/* parses a pattern given as two hex digits per byte */
+static int one_parse_pattern(const char *hex, struct one_pattern *pat)
+{
+	size_t len = strlen(hex);
+
+	if (!len || len % 2 || len / 2 > ONE_PATTERN_MAX)
+		return -EINVAL;
+
+	memset(pat, 0, sizeof(*pat));
+	pat->len = len / 2;
+
+	return hex2bin(pat->bytes, hex, pat->len);
+}
+
+static ssize_t one_pattern_show(struct device *device,
+		struct device_attribute *attr, char *buf)
+{
+	struct one_dev *dev = dev_get_drvdata(device);
+	struct one_pattern pat;
+	int idx;
+
+	idx = srcu_read_lock(&one_srcu);
+	pat = srcu_dereference(dev->fill, &one_srcu)->pat;
+	srcu_read_unlock(&one_srcu, idx);
+
+	return sprintf(buf, "%*phN\n", pat.len, pat.bytes);
+}
+
+/*
+ * Sets the pattern of a minor. Files opened before keep the pattern they
+ * had, the new one is used from the next open on.
+ */
+static ssize_t one_pattern_store(struct device *device,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct one_dev *dev = dev_get_drvdata(device);
+	char hex[2 * ONE_PATTERN_MAX + 1];
+	struct one_fill *fill, *old;
+	struct one_pattern pat;
+
+	/* the field width is 2 * ONE_PATTERN_MAX */
+	if (sscanf(buf, "%128s", hex) != 1 || one_parse_pattern(hex, &pat))
+		return -EINVAL;
+
+	fill = one_fill_alloc(&pat, true);
+
+	if (!fill)
+		return -ENOMEM;
+
+	old = unrcu_pointer(xchg(&dev->fill, RCU_INITIALIZER(fill)));
+	synchronize_srcu(&one_srcu);
+	one_fill_put(old);
+
+	return count;
+}
+
+static DEVICE_ATTR(pattern, 0644, one_pattern_show, one_pattern_store);
+
+/*
+ * Per mode totals, with the average throughput in MB/s, followed by the
+ * bytes written that did not match the stream and the stream offset of
+ * the first of them, -1 if there was none.
+ */
+static ssize_t one_stats_show(struct device *device,
+		struct device_attribute *attr, char *buf)
+{
+	struct one_dev *dev = dev_get_drvdata(device);
+	struct one_stats sum, *st;
+	ssize_t len = 0;
+	int cpu, m;
+
+	memset(&sum, 0, sizeof(sum));
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+
+		for (m = 0; m < ONE_NR_MODES; m++) {
+			sum.calls[m] += READ_ONCE(st->calls[m]);
+			sum.bytes[m] += READ_ONCE(st->bytes[m]);
+			sum.ns[m] += READ_ONCE(st->ns[m]);
+		}
+
+		sum.mismatched += READ_ONCE(st->mismatched);
+	}
+
+	len += sysfs_emit_at(buf, len, "mode calls bytes ns MB/s\n");
+
+	for (m = 0; m < ONE_NR_MODES; m++)
+		len += sysfs_emit_at(buf, len, "%s %llu %llu %llu %llu\n",
+				one_mode_names[m], sum.calls[m], sum.bytes[m],
+				sum.ns[m], sum.ns[m] ?
+				div64_u64(sum.bytes[m] * 1000, sum.ns[m]) : 0);
+
+	len += sysfs_emit_at(buf, len, "mismatched %llu\n", sum.mismatched);
+	len += sysfs_emit_at(buf, len, "first_mismatch %lld\n",
+			(long long)atomic64_read(&dev->first_mismatch));
+
+	return len;
+}
+
+/* any write resets the counters */
+static ssize_t one_stats_store(struct device *device,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct one_dev *dev = dev_get_drvdata(device);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dev->stats, cpu), 0,
+				sizeof(struct one_stats));
+
+	atomic64_set(&dev->first_mismatch, -1);
+	return count;
+}
+
+static DEVICE_ATTR(stats, 0644, one_stats_show, one_stats_store);
+
+static struct attribute *one_attrs[] = {
+	&dev_attr_pattern.attr,
+	&dev_attr_stats.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(one);
+
 /*
  * Allocated resources cleanup.
  */
 void one_cleanup(void)
 {
+	struct one_dev *d;
 	dev_t dev;
+	int i;
 
 	dev = MKDEV(one_major, one_minor);
 
-	if (&one->one_cdev)
-		cdev_del(&one->one_cdev);
+	for (i = 0; i < nr_devs; i++) {
+		d = one[i];
+
+		if (!d)
+			continue;
+
+		if (d->one_cdev.ops)
+			cdev_del(&d->one_cdev);
+
+		if (d->one_device)
+			device_destroy(one_class,
+					MKDEV(one_major, one_minor + i));
+
+		if (rcu_access_pointer(d->fill))
+			one_fill_put(rcu_dereference_protected(d->fill, 1));
+
+		free_percpu(d->stats);
+		kmem_cache_free(one_dev_cache, d);
+		one[i] = NULL;
+	}
+
+	if (one_class)
+		class_destroy(one_class);
+	one_class = NULL;
+
+	kmem_cache_destroy(one_dev_cache);
+	one_dev_cache = NULL;
+
+	unregister_chrdev_region(dev, nr_devs);
+}
+
+/*
+ * Sets up minor i, its /dev file and its char device. It takes a reference
+ * on the default fill, which must be ready before the device shows up.
+ */
+static int __init one_setup_dev(int i, struct one_fill *fill)
+{
+	dev_t devno = MKDEV(one_major, one_minor + i);
+	struct device *device;
+	struct one_dev *d;
+	int err;
+
+	d = kmem_cache_zalloc(one_dev_cache, GFP_KERNEL);
 
-	if (one->one_device)
-		device_destroy(one->one_class, dev);
+	if (!d)
+		return -ENOMEM;
 
-	if (one->one_class)
-		class_destroy(one->one_class);
+	one[i] = d;
+	kref_get(&fill->ref);
+	RCU_INIT_POINTER(d->fill, fill);
+	d->stats = alloc_percpu(struct one_stats);
 
-	kfree(one);
-	unregister_chrdev_region(dev, NR_DEVS);
+	if (!d->stats)
+		return -ENOMEM;
+
+	atomic64_set(&d->first_mismatch, -1);
+
+	/* creates the device under /dev in cooperation with udev */
+	if (nr_devs == 1)
+		device = device_create_with_groups(one_class, NULL, devno, d,
+				one_groups, DEVNAME);
+	else
+		device = device_create_with_groups(one_class, NULL, devno, d,
+				one_groups, "%s%d", DEVNAME, i);
+
+	if (IS_ERR(device)) {
+		pr_err("Error creating device %s%d", DEVNAME, i);
+		return PTR_ERR(device);
+	}
+
+	d->one_device = device;
+
+	/* char device registration */
+	cdev_init(&d->one_cdev, &one_fops);
+	d->one_cdev.owner = THIS_MODULE;
+	err = cdev_add(&d->one_cdev, devno, 1);
+
+	if (err) {
+		pr_notice("Error %d adding /dev/%s", err, dev_name(device));
+		return err;
+	}
+
+	return 0;
 }
 
 /*
@@ -125,61 +1234,72 @@ void one_cleanup(void)
 static int __init one_init(void)
 {
 	int ret = 0;
-	int err = 0;
-	int devno;
+	int i;
 	dev_t dev = 0;
+	struct one_pattern pat;
+	struct one_fill *fill;
 
-	/* allocates a major and minor dynamically */
-	ret = alloc_chrdev_region(&dev, one_minor, NR_DEVS, DEVNAME);
+	if (nr_devs < 1 || nr_devs > MAX_DEVS) {
+		pr_err("nr_devs must be between 1 and %d\n", MAX_DEVS);
+		return -EINVAL;
+	}
+
+	if (one_parse_pattern(pattern, &pat)) {
+		pr_err("invalid pattern \"%s\"\n", pattern);
+		return -EINVAL;
+	}
+
+	/* allocates a major and minors dynamically */
+	ret = alloc_chrdev_region(&dev, one_minor, nr_devs, DEVNAME);
 	one_major = MAJOR(dev);
 
 	if (ret < 0) {
-		pr_err(KERN_ERR "one: can't get major %d\n", one_major);
+		pr_err("one: can't get major %d\n", one_major);
 		return ret;
 	}
 
-	pr_info("%s<Major, Minor>: <%d, %d>\n",
-			DEVNAME, MAJOR(dev), MINOR(dev));
-	one = kzalloc(sizeof(struct one_dev), GFP_KERNEL);
+	pr_info("%s<Major, Minor>: <%d, %d..%d>\n", DEVNAME, MAJOR(dev),
+			MINOR(dev), MINOR(dev) + nr_devs - 1);
+	one_dev_cache = kmem_cache_create(DEVNAME, sizeof(struct one_dev), 0,
+			SLAB_HWCACHE_ALIGN, NULL);
 
-	if (!one) {
-		unregister_chrdev_region(dev, NR_DEVS);
+	if (!one_dev_cache) {
+		unregister_chrdev_region(dev, nr_devs);
 		ret = -ENOMEM;
 		return ret;
 	}
 
 	/* creates the device class under /sys */
-	one->one_class = class_create(THIS_MODULE, CLASSNAME);
+	one_class = class_create(THIS_MODULE, CLASSNAME);
 
-	if (!one->one_class) {
+	if (IS_ERR(one_class)) {
 		pr_err("Error creating device class %s", DEVNAME);
-		ret = -ENOMEM;
+		ret = PTR_ERR(one_class);
+		one_class = NULL;
 		goto fail;
 	}
 
-	/* creates the device class under /dev in cooperation with udev */
-	one->one_device = device_create(one->one_class, NULL,
-			dev, NULL, DEVNAME);
+	fill = one_fill_alloc(&pat, true);
 
-	if (!one->one_device) {
-		pr_err("Error creating device %s", DEVNAME);
+	if (!fill) {
+		pr_err("Error allocating the fill pages\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
-	/* char device registration */
-	devno = MKDEV(one_major, one_minor);
-	cdev_init(&one->one_cdev, &one_fops);
-	one->one_cdev.owner = THIS_MODULE;
-	one->one_cdev.ops = &one_fops;
-	err = cdev_add(&one->one_cdev, devno, NR_DEVS);
+	for (i = 0; i < nr_devs; i++) {
+		ret = one_setup_dev(i, fill);
 
-	if (err) {
-		pr_notice("Error %d adding /dev/one", err);
-		ret = err;
-		goto fail;
+		if (ret)
+			break;
 	}
 
+	/* the minors hold their own references */
+	one_fill_put(fill);
+
+	if (ret)
+		goto fail;
+
 	return 0;
 fail:
 	one_cleanup();
@@ -0,0 +1,75 @@
+/*
+ * /dev/one driver interface
+ *
+ * Copyright (C) 2014 Rafael do Nascimento Pereira <rnp@25ghz.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * ioctl commands shared by the one driver and the userspace programs
+ * using it.
+ */
+
+#ifndef _ONE_H
+#define _ONE_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define ONE_PATTERN_MAX 64
+
+/* len bytes repeated over the whole stream, starting at offset 0 */
+struct one_pattern {
+	__u32 len;
+	__u8  bytes[ONE_PATTERN_MAX];
+};
+
+#define ONE_IOC_MAGIC        0xB1
+
+/* set and get the pattern of an open file */
+#define ONE_IOC_SET_PATTERN  _IOW(ONE_IOC_MAGIC, 1, struct one_pattern)
+#define ONE_IOC_GET_PATTERN  _IOR(ONE_IOC_MAGIC, 2, struct one_pattern)
+
+/*
+ * switch a file to the pseudo-random stream of the given seed, setting a
+ * pattern switches it back
+ */
+#define ONE_IOC_SET_SEED     _IOW(ONE_IOC_MAGIC, 3, __u64)
+
+/*
+ * ONE_F_NOCACHE: reads of at least the nocache_threshold module parameter
+ * are written to the user buffer with non-temporal stores, keeping the
+ * data out of the CPU caches. Opening the device with O_DIRECT does the
+ * same.
+ */
+#define ONE_F_NOCACHE        0x1
+#define ONE_F_ALL            ONE_F_NOCACHE
+
+/* set and get the ONE_F_* flags of an open file */
+#define ONE_IOC_SET_FLAGS    _IOW(ONE_IOC_MAGIC, 4, __u32)
+#define ONE_IOC_GET_FLAGS    _IOR(ONE_IOC_MAGIC, 5, __u32)
+
+/*
+ * The pseudo-random stream is made of 64 bit little endian words, word i
+ * being stored at offset 8 * i. Every word only depends on the seed and
+ * its index (splitmix64), so any range of the stream can be regenerated
+ * and verified without producing what comes before it. It is fast, not
+ * cryptographically secure.
+ */
+static inline __u64 one_prng_word(__u64 seed, __u64 index)
+{
+	__u64 z = seed + (index + 1) * 0x9e3779b97f4a7c15ULL;
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+#endif /* _ONE_H */